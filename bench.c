@@ -0,0 +1,857 @@
+/*
+Microbenchmarks of the hot kernels, each one measured in isolation.
+Reports cycles per element with warm caches (data touched right before)
+and cold caches (a large buffer written in between), on a single thread
+pinned to one CPU. An element is a sample-centroid pair for argmin, a
+sample for accumulate, a centroid for converged and a pair of vectors
+for the distance kernels. Usage: ./bench [cpu]
+
+./bench scaling [threads] runs the clustering phases from 1 to threads
+threads on a fixed problem (strong scaling) and on a problem growing
+with the thread count (weak scaling). It prints speedup and parallel
+efficiency per phase and flags the phase that stops scaling first.
+
+./bench seeding compares the cost and quality of create_centroids and
+afkmc2_centroids on a large clustered set of samples.
+
+./bench --save FILE writes every trial to a JSON baseline and
+./bench --compare FILE [--threshold PERCENT] compares a new run with it.
+A benchmark regresses when its median is more than PERCENT (5 by
+default) slower and a Mann-Whitney U test over the trials gives p < 0.05.
+The exit status is 1 if any benchmark regressed
+*/
+
+#define _GNU_SOURCE
+#define KMEANS_BENCH
+#include "main.c"
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include "hamming.h"
+#include "kmodes.h"
+#include "dtw.h"
+#include "stream.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define BENCH_REPEATS 15
+#define BENCH_FLUSH_SIZE (64 << 20) // Larger than any last level cache
+#define BENCH_P_VALUE 0.05
+#define SCALING_REPEATS 5
+#define SCALING_THRESHOLD 0.7 // Parallel efficiency under which a phase stops scaling
+#define SCALING_PHASES 9
+
+int hamming_distance_scalar(const uint64_t *a, const uint64_t *b, int words);
+int hamming_distance_popcnt(const uint64_t *a, const uint64_t *b, int words);
+int hamming_distance_avx512(const uint64_t *a, const uint64_t *b, int words);
+
+typedef struct
+{
+  char name[64];
+  double warm[BENCH_REPEATS]; // Cycles per element of every trial
+  double cold[BENCH_REPEATS];
+} BenchResult;
+
+typedef struct
+{
+  BenchResult *items;
+  int count;
+  int capacity;
+} BenchResults;
+
+typedef void (*Kernel)(void *arg);
+
+char *flush_buffer;
+volatile int sink;
+
+//--------------------------------------------------
+// Evicts the caches by writing a buffer bigger than all of them
+//--------------------------------------------------
+void flush_caches(void)
+{
+  for (size_t i = 0; i < BENCH_FLUSH_SIZE; i += 64)
+    flush_buffer[i]++;
+}
+
+int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+//--------------------------------------------------
+// Cycles per element of BENCH_REPEATS runs of a kernel
+//--------------------------------------------------
+void measure(Kernel kernel, void *arg, double elements, bool cold, double *cycles)
+{
+  kernel(arg);
+  for (int r = 0; r < BENCH_REPEATS; r++)
+  {
+    if (cold)
+      flush_caches();
+    uint64_t start = __rdtsc();
+    kernel(arg);
+    cycles[r] = (__rdtsc() - start) / elements;
+  }
+}
+
+double median(const double *trials, int count)
+{
+  double sorted[BENCH_REPEATS];
+  memcpy(sorted, trials, count * sizeof(double));
+  qsort(sorted, count, sizeof(double), compare_double);
+  return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+void bench(BenchResults *results, const char *name, Kernel kernel, void *arg, double elements)
+{
+  BenchResult result = {0};
+  snprintf(result.name, sizeof(result.name), "%s", name);
+  measure(kernel, arg, elements, false, result.warm);
+  measure(kernel, arg, elements, true, result.cold);
+  printf("%-40s %10.3f %10.3f\n", result.name, median(result.warm, BENCH_REPEATS), median(result.cold, BENCH_REPEATS));
+  da_append(results, result);
+}
+
+//--------------------------------------------------
+// Writes every trial of every benchmark as JSON
+//--------------------------------------------------
+bool save_baseline(const char *path, BenchResults *results)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not write baseline %s\n", path);
+    return false;
+  }
+
+  fprintf(file, "{\n  \"benchmarks\": [\n");
+  for (int i = 0; i < results->count; i++)
+  {
+    BenchResult *result = &results->items[i];
+    fprintf(file, "    {\"name\": \"%s\", \"warm\": [", result->name);
+    for (int r = 0; r < BENCH_REPEATS; r++)
+      fprintf(file, "%s%.6f", r ? ", " : "", result->warm[r]);
+    fprintf(file, "], \"cold\": [");
+    for (int r = 0; r < BENCH_REPEATS; r++)
+      fprintf(file, "%s%.6f", r ? ", " : "", result->cold[r]);
+    fprintf(file, "]}%s\n", i + 1 < results->count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return true;
+}
+
+//--------------------------------------------------
+// Parses the numbers of the array following key, returns the count read
+//--------------------------------------------------
+int parse_trials(const char *text, const char *key, double *trials)
+{
+  const char *at = strstr(text, key);
+  if (at == NULL || (at = strchr(at, '[')) == NULL)
+    return 0;
+  at++;
+  int count = 0;
+  while (count < BENCH_REPEATS)
+  {
+    char *end;
+    double value = strtod(at, &end);
+    if (end == at)
+      break;
+    trials[count++] = value;
+    at = end + strspn(end, ", \n");
+  }
+  return count;
+}
+
+//--------------------------------------------------
+// Reads a baseline written by save_baseline
+//--------------------------------------------------
+bool load_baseline(const char *path, BenchResults *baseline)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not read baseline %s\n", path);
+    return false;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    const char *name = strstr(line, "\"name\": \"");
+    if (name == NULL)
+      continue;
+    name += strlen("\"name\": \"");
+    BenchResult result = {0};
+    size_t length = strcspn(name, "\"");
+    snprintf(result.name, sizeof(result.name), "%.*s", (int)length, name);
+    if (parse_trials(line, "\"warm\"", result.warm) != BENCH_REPEATS ||
+        parse_trials(line, "\"cold\"", result.cold) != BENCH_REPEATS)
+    {
+      fprintf(stderr, "ERROR: Baseline %s has a malformed entry for %s\n", path, result.name);
+      fclose(file);
+      return false;
+    }
+    da_append(baseline, result);
+  }
+  fclose(file);
+  return true;
+}
+
+//--------------------------------------------------
+// Two-sided p-value of the Mann-Whitney U test that both sets of trials
+// come from the same distribution, using the normal approximation
+//--------------------------------------------------
+double mann_whitney_p(const double *a, const double *b, int n)
+{
+  double u = 0.0;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      u += a[i] < b[j] ? 1.0 : a[i] == b[j] ? 0.5 : 0.0;
+
+  double mean = n * n / 2.0;
+  double deviation = sqrt(n * n * (2.0 * n + 1.0) / 12.0);
+  double z = (fabs(u - mean) - 0.5) / deviation;
+  return z <= 0.0 ? 1.0 : erfc(z / sqrt(2.0));
+}
+
+//--------------------------------------------------
+// Prints the change of every benchmark found in both runs.
+// Returns the number of significant regressions over threshold percent
+//--------------------------------------------------
+int compare_baseline(BenchResults *baseline, BenchResults *results, double threshold)
+{
+  int regressions = 0;
+  printf("\n%-40s %-5s %10s %10s %9s %8s\n", "benchmark", "cache", "baseline", "current", "delta", "p");
+  for (int i = 0; i < results->count; i++)
+  {
+    BenchResult *current = &results->items[i];
+    BenchResult *before = NULL;
+    for (int j = 0; j < baseline->count && before == NULL; j++)
+      if (strcmp(baseline->items[j].name, current->name) == 0)
+        before = &baseline->items[j];
+    if (before == NULL)
+    {
+      printf("%-40s not in baseline\n", current->name);
+      continue;
+    }
+
+    for (int cold = 0; cold <= 1; cold++)
+    {
+      const double *old_trials = cold ? before->cold : before->warm;
+      const double *new_trials = cold ? current->cold : current->warm;
+      double old_median = median(old_trials, BENCH_REPEATS);
+      double new_median = median(new_trials, BENCH_REPEATS);
+      double delta = 100.0 * (new_median - old_median) / old_median;
+      double p = mann_whitney_p(old_trials, new_trials, BENCH_REPEATS);
+      bool significant = p < BENCH_P_VALUE;
+      const char *verdict = "";
+      if (significant && delta > threshold)
+      {
+        verdict = "REGRESSION";
+        regressions++;
+      }
+      else if (significant && delta < -threshold)
+        verdict = "improvement";
+      printf("%-40s %-5s %10.3f %10.3f %+8.1f%% %8.4f %s\n", current->name, cold ? "cold" : "warm",
+             old_median, new_median, delta, p, verdict);
+    }
+  }
+  return regressions;
+}
+
+//--------------------------------------------------
+// Kernel arguments and wrappers
+//--------------------------------------------------
+typedef struct
+{
+  Centroids *centroids;
+  Samples *samples;
+  Centroids *other;
+  Candidates *candidates;
+} PointsArg;
+
+void kernel_assign(void *arg)
+{
+  assign_step(((PointsArg *)arg)->centroids, ((PointsArg *)arg)->samples);
+}
+
+void kernel_partial_assign(void *arg)
+{
+  partial_assign_step(((PointsArg *)arg)->centroids, ((PointsArg *)arg)->samples);
+}
+
+void kernel_mixed_assign(void *arg)
+{
+  mixed_assign_step(((PointsArg *)arg)->centroids, ((PointsArg *)arg)->samples);
+}
+
+void kernel_candidate_assign(void *arg)
+{
+  // Includes one full assignment every CANDIDATE_REFRESH calls
+  PointsArg *points = arg;
+  candidate_assign_step(points->centroids, points->samples, points->candidates);
+}
+
+void kernel_update(void *arg)
+{
+  // The update moves centroids, work on a copy so every run is the same
+  PointsArg *points = arg;
+  memcpy(points->other->items, points->centroids->items, points->centroids->count * sizeof(Vector2));
+  update_step(points->other, points->samples, __FLT_MAX__);
+}
+
+void kernel_converged(void *arg)
+{
+  sink += converged(((PointsArg *)arg)->centroids, ((PointsArg *)arg)->other);
+}
+
+typedef struct
+{
+  const void *a;
+  const void *b;
+  int size;
+  int pairs;
+  int window;
+  int (*hamming)(const uint64_t *, const uint64_t *, int);
+} PairsArg;
+
+void kernel_hamming(void *arg)
+{
+  PairsArg *p = arg;
+  const uint64_t *a = p->a;
+  int total = 0;
+  for (int i = 0; i < p->pairs; i++)
+    total += p->hamming(&a[(size_t)i * p->size], p->b, p->size);
+  sink += total;
+}
+
+void kernel_mismatch(void *arg)
+{
+  PairsArg *p = arg;
+  const uint8_t *a = p->a;
+  int total = 0;
+  for (int i = 0; i < p->pairs; i++)
+    total += mismatch_distance(&a[(size_t)i * p->size], p->b, p->size);
+  sink += total;
+}
+
+void kernel_dtw(void *arg)
+{
+  PairsArg *p = arg;
+  const float *a = p->a;
+  float *rows = malloc(2 * ((size_t)p->size + 1) * sizeof(float));
+  assert(rows != NULL && "Buy more RAM lol");
+  float total = 0.0f;
+  for (int i = 0; i < p->pairs; i++)
+    total += dtw_distance(&a[(size_t)i * p->size], p->b, p->size, p->window, __FLT_MAX__, rows);
+  free(rows);
+  sink += (int)total;
+}
+
+typedef struct
+{
+  StreamClusterer *clusterer;
+  const float *points;
+  int count;
+} StreamArg;
+
+void kernel_stream(void *arg)
+{
+  // One producer pushes while the batches are drained, as a consumer would
+  StreamArg *p = arg;
+  int pushed = 0;
+  while (pushed < p->count)
+  {
+    pushed += stream_push(p->clusterer, 0, &p->points[(size_t)pushed * p->clusterer->dims], p->count - pushed);
+    while (stream_poll(p->clusterer) > 0)
+      ;
+  }
+}
+
+void *random_bytes(size_t size)
+{
+  unsigned char *data = malloc(size);
+  assert(data != NULL && "Buy more RAM lol");
+  for (size_t i = 0; i < size; i++)
+    data[i] = rand();
+  return data;
+}
+
+//--------------------------------------------------
+// Runs every kernel benchmark and appends its results
+//--------------------------------------------------
+void run_benchmarks(BenchResults *results)
+{
+  char name[64];
+  int n = 100000;
+  Samples samples = {0};
+  for (int i = 0; i < n; i++)
+  {
+    Sample sample = {get_random_float(0, WINDOW_WIDTH), get_random_float(0, WINDOW_HEIGHT), -1, 0.0f, 1};
+    da_append(&samples, sample);
+  }
+
+  int ks[] = {3, 16, 64, 256};
+  for (size_t j = 0; j < sizeof(ks) / sizeof(ks[0]); j++)
+  {
+    Centroids centroids = {0};
+    Centroids other = {0};
+    for (int k = 0; k < ks[j]; k++)
+    {
+      Vector2 position = {get_random_float(0, WINDOW_WIDTH), get_random_float(0, WINDOW_HEIGHT)};
+      da_append(&centroids, position);
+      da_append(&other, position);
+    }
+    Candidates candidates = {0};
+    PointsArg arg = {&centroids, &samples, &other, &candidates};
+
+    snprintf(name, sizeof(name), "argmin d=2 k=%d", ks[j]);
+    bench(results, name, kernel_assign, &arg, (double)n * ks[j]);
+    snprintf(name, sizeof(name), "argmin partial d=2 k=%d", ks[j]);
+    bench(results, name, kernel_partial_assign, &arg, (double)n * ks[j]);
+    snprintf(name, sizeof(name), "argmin mixed d=2 k=%d", ks[j]);
+    bench(results, name, kernel_mixed_assign, &arg, (double)n * ks[j]);
+    snprintf(name, sizeof(name), "argmin candidates d=2 k=%d", ks[j]);
+    bench(results, name, kernel_candidate_assign, &arg, (double)n * ks[j]);
+    snprintf(name, sizeof(name), "accumulate d=2 k=%d", ks[j]);
+    bench(results, name, kernel_update, &arg, n);
+    snprintf(name, sizeof(name), "converged k=%d", ks[j]);
+    bench(results, name, kernel_converged, &arg, ks[j]);
+
+    free(centroids.items);
+    free(other.items);
+    free(candidates.items);
+    free(candidates.anchor);
+  }
+
+  int pairs = 20000;
+  int words[] = {4, 16, 32};
+  for (size_t j = 0; j < sizeof(words) / sizeof(words[0]); j++)
+  {
+    PairsArg arg = {random_bytes((size_t)pairs * words[j] * 8), random_bytes(words[j] * 8), words[j], pairs, 0,
+                    hamming_distance_scalar};
+    snprintf(name, sizeof(name), "hamming bits=%d width=64", words[j] * 64);
+    bench(results, name, kernel_hamming, &arg, pairs);
+    if (__builtin_cpu_supports("popcnt"))
+    {
+      arg.hamming = hamming_distance_popcnt;
+      snprintf(name, sizeof(name), "hamming bits=%d width=64 popcnt", words[j] * 64);
+      bench(results, name, kernel_hamming, &arg, pairs);
+    }
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+    {
+      arg.hamming = hamming_distance_avx512;
+      snprintf(name, sizeof(name), "hamming bits=%d width=512", words[j] * 64);
+      bench(results, name, kernel_hamming, &arg, pairs);
+    }
+    free((void *)arg.a);
+    free((void *)arg.b);
+  }
+
+  int attributes[] = {16, 64, 256};
+  for (size_t j = 0; j < sizeof(attributes) / sizeof(attributes[0]); j++)
+  {
+    PairsArg arg = {random_bytes((size_t)pairs * attributes[j]), random_bytes(attributes[j]), attributes[j], pairs, 0, NULL};
+    snprintf(name, sizeof(name), "mismatch d=%d", attributes[j]);
+    bench(results, name, kernel_mismatch, &arg, pairs);
+    free((void *)arg.a);
+    free((void *)arg.b);
+  }
+
+  int lengths[] = {64, 256};
+  for (size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++)
+  {
+    int series = 200;
+    float *a = malloc((size_t)series * lengths[j] * sizeof(float));
+    float *b = malloc(lengths[j] * sizeof(float));
+    assert(a != NULL && b != NULL && "Buy more RAM lol");
+    for (int i = 0; i < series * lengths[j]; i++)
+      a[i] = get_random_float(-1, 1);
+    for (int i = 0; i < lengths[j]; i++)
+      b[i] = get_random_float(-1, 1);
+    PairsArg arg = {a, b, lengths[j], series, lengths[j] / 10, NULL};
+    snprintf(name, sizeof(name), "dtw length=%d window=%d", lengths[j], lengths[j] / 10);
+    bench(results, name, kernel_dtw, &arg, series);
+    free(a);
+    free(b);
+  }
+
+  int stream_points = 20000;
+  float *points = malloc((size_t)stream_points * 2 * sizeof(float));
+  assert(points != NULL && "Buy more RAM lol");
+  for (int i = 0; i < stream_points * 2; i++)
+    points[i] = get_random_float(0, WINDOW_WIDTH);
+  for (size_t j = 0; j < sizeof(ks) / sizeof(ks[0]); j++)
+  {
+    StreamClusterer clusterer;
+    if (!stream_init(&clusterer, ks[j], 2, 1))
+      break;
+    StreamArg arg = {&clusterer, points, stream_points};
+    snprintf(name, sizeof(name), "stream d=2 k=%d", ks[j]);
+    bench(results, name, kernel_stream, &arg, (double)stream_points * ks[j]);
+    stream_free(&clusterer);
+  }
+  free(points);
+
+  free(samples.items);
+}
+
+//--------------------------------------------------
+// Inputs of every clustering phase, sized for a given scale
+//--------------------------------------------------
+typedef struct
+{
+  Samples samples;
+  Centroids centroids;
+  BinarySamples bits;
+  BinaryCentroids bit_centroids;
+  CategoricalSamples codes;
+  Modes modes;
+  Series series;
+  SeriesCentroids series_centroids;
+} Problem;
+
+void problem_init(Problem *p, int scale)
+{
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < 200000 * scale; i++)
+  {
+    Sample sample = {get_random_float(0, WINDOW_WIDTH), get_random_float(0, WINDOW_HEIGHT), -1, 0.0f, 1};
+    da_append(&p->samples, sample);
+  }
+  for (int k = 0; k < 16; k++)
+  {
+    Vector2 position = {get_random_float(0, WINDOW_WIDTH), get_random_float(0, WINDOW_HEIGHT)};
+    da_append(&p->centroids, position);
+  }
+
+  uint64_t words[16];
+  binary_samples_init(&p->bits, 1024);
+  for (int i = 0; i < 20000 * scale; i++)
+  {
+    for (int w = 0; w < 16; w++)
+      words[w] = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+    binary_samples_append(&p->bits, words);
+  }
+  create_binary_centroids(&p->bit_centroids, &p->bits, 16);
+
+  uint8_t codes[32];
+  categorical_samples_init(&p->codes, 32);
+  for (int i = 0; i < 50000 * scale; i++)
+  {
+    for (int j = 0; j < 32; j++)
+      codes[j] = rand() % 8;
+    categorical_samples_append(&p->codes, codes);
+  }
+  create_modes(&p->modes, &p->codes, 8);
+
+  float values[128];
+  series_init(&p->series, 128);
+  for (int i = 0; i < 2000 * scale; i++)
+  {
+    for (int t = 0; t < 128; t++)
+      values[t] = sinf(t * (0.05f + (i % 4) * 0.05f)) + get_random_float(-0.2f, 0.2f);
+    series_append(&p->series, values);
+  }
+  create_series_centroids(&p->series_centroids, &p->series, 4);
+  dtw_assign_step(&p->series_centroids, &p->series, 12);
+}
+
+void problem_free(Problem *p)
+{
+  free(p->samples.items);
+  free(p->centroids.items);
+  binary_samples_free(&p->bits);
+  free(p->bit_centroids.items);
+  categorical_samples_free(&p->codes);
+  free(p->modes.items);
+  series_free(&p->series);
+  free(p->series_centroids.items);
+}
+
+//--------------------------------------------------
+// Runs one phase. Updates work on copies of the centroids so every
+// repetition sees the same input
+//--------------------------------------------------
+void run_phase(Problem *p, int phase)
+{
+  switch (phase)
+  {
+  case 0:
+    assign_step(&p->centroids, &p->samples);
+    break;
+  case 1:
+    sink += trim_cutoff(&p->samples, 0.05f) > 0.0f;
+    break;
+  case 2:
+  {
+    Centroids copy = {malloc(p->centroids.count * sizeof(Vector2)), p->centroids.count, p->centroids.count};
+    memcpy(copy.items, p->centroids.items, copy.count * sizeof(Vector2));
+    update_step(&copy, &p->samples, __FLT_MAX__);
+    free(copy.items);
+    break;
+  }
+  case 3:
+    hamming_assign_step(&p->bit_centroids, &p->bits);
+    break;
+  case 4:
+  {
+    BinaryCentroids copy = p->bit_centroids;
+    size_t size = (size_t)copy.count * copy.words * sizeof(uint64_t);
+    copy.items = malloc(size);
+    memcpy(copy.items, p->bit_centroids.items, size);
+    majority_update_step(&copy, &p->bits);
+    free(copy.items);
+    break;
+  }
+  case 5:
+    kmodes_assign_step(&p->modes, &p->codes);
+    break;
+  case 6:
+  {
+    Modes copy = p->modes;
+    copy.items = malloc((size_t)copy.count * copy.attributes);
+    memcpy(copy.items, p->modes.items, (size_t)copy.count * copy.attributes);
+    kmodes_update_step(&copy, &p->codes);
+    free(copy.items);
+    break;
+  }
+  case 7:
+    dtw_assign_step(&p->series_centroids, &p->series, 12);
+    break;
+  case 8:
+  {
+    SeriesCentroids copy = p->series_centroids;
+    copy.items = malloc((size_t)copy.count * copy.length * sizeof(float));
+    memcpy(copy.items, p->series_centroids.items, (size_t)copy.count * copy.length * sizeof(float));
+    dba_update_step(&copy, &p->series, 12);
+    free(copy.items);
+    break;
+  }
+  }
+}
+
+const char *phase_names[SCALING_PHASES] = {
+    "2d assign", "2d trim cutoff", "2d update",
+    "hamming assign", "majority update",
+    "kmodes assign", "kmodes update",
+    "dtw assign", "dba update"};
+
+//--------------------------------------------------
+// Median wall time of every phase with the given thread count
+//--------------------------------------------------
+void time_phases(Problem *p, int threads, double *seconds)
+{
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#endif
+  for (int phase = 0; phase < SCALING_PHASES; phase++)
+  {
+    double times[SCALING_REPEATS];
+    run_phase(p, phase);
+    for (int r = 0; r < SCALING_REPEATS; r++)
+    {
+      double start = now_seconds();
+      run_phase(p, phase);
+      times[r] = now_seconds() - start;
+    }
+    qsort(times, SCALING_REPEATS, sizeof(double), compare_double);
+    seconds[phase] = times[SCALING_REPEATS / 2];
+  }
+}
+
+//--------------------------------------------------
+// Strong or weak scaling from 1 to max_threads threads.
+// Strong scaling efficiency is T1 / (t * Tt), weak scaling efficiency,
+// with t times more work, is T1 / Tt
+//--------------------------------------------------
+void run_scaling(int max_threads, bool weak)
+{
+  int counts[32];
+  int steps = 0;
+  for (int t = 1; t < max_threads && steps < 31; t *= 2)
+    counts[steps++] = t;
+  counts[steps++] = max_threads;
+
+  double base[SCALING_PHASES];
+  int stops_at[SCALING_PHASES];
+  double worst[SCALING_PHASES];
+  for (int phase = 0; phase < SCALING_PHASES; phase++)
+  {
+    stops_at[phase] = 0;
+    worst[phase] = 1.0;
+  }
+
+  printf("\n%s scaling\n%-8s %-18s %12s %10s %10s\n", weak ? "Weak" : "Strong",
+         "threads", "phase", "seconds", "speedup", "efficiency");
+  Problem p;
+  if (!weak)
+    problem_init(&p, 1);
+  for (int step = 0; step < steps; step++)
+  {
+    int threads = counts[step];
+    if (weak)
+      problem_init(&p, threads);
+
+    double seconds[SCALING_PHASES];
+    time_phases(&p, threads, seconds);
+    for (int phase = 0; phase < SCALING_PHASES; phase++)
+    {
+      if (step == 0)
+        base[phase] = seconds[phase];
+      double speedup = base[phase] / seconds[phase];
+      double efficiency = weak ? speedup : speedup / threads;
+      printf("%-8d %-18s %12.6f %10.2f %10.2f\n", threads, phase_names[phase], seconds[phase],
+             weak ? speedup * threads : speedup, efficiency);
+      if (stops_at[phase] == 0 && efficiency < SCALING_THRESHOLD)
+        stops_at[phase] = threads;
+      if (efficiency < worst[phase])
+        worst[phase] = efficiency;
+    }
+
+    if (weak)
+      problem_free(&p);
+  }
+  if (!weak)
+    problem_free(&p);
+
+  // The phase that drops under the threshold at the lowest thread count,
+  // the lowest efficiency breaks ties
+  int first = -1;
+  for (int phase = 0; phase < SCALING_PHASES; phase++)
+  {
+    if (stops_at[phase] == 0)
+      continue;
+    if (first < 0 || stops_at[phase] < stops_at[first] ||
+        (stops_at[phase] == stops_at[first] && worst[phase] < worst[first]))
+      first = phase;
+  }
+  if (first >= 0)
+    printf("First phase to stop scaling: %s (efficiency under %.2f at %d threads)\n",
+           phase_names[first], SCALING_THRESHOLD, stops_at[first]);
+  else
+    printf("Every phase kept an efficiency of %.2f or more\n", SCALING_THRESHOLD);
+}
+
+//--------------------------------------------------
+// Seeding cost and inertia, right after seeding and after Lloyd
+//--------------------------------------------------
+void run_seeding(void)
+{
+  int k = 20;
+  int seeds = 5;
+  Samples samples = {0};
+  for (int b = 0; b < k; b++)
+  {
+    Vector2 center = {get_random_float(0, WINDOW_WIDTH), get_random_float(0, WINDOW_HEIGHT)};
+    generate_samples(&samples, center, 50000, 15.0);
+  }
+
+  printf("%-12s %12s %16s %16s\n", "seeding", "seconds", "seed inertia", "final inertia");
+  for (int method = 0; method < 2; method++)
+  {
+    double seconds = 0.0, seed_inertia = 0.0, final_inertia = 0.0;
+    for (int seed = 0; seed < seeds; seed++)
+    {
+      srand(seed + 1);
+      Centroids centroids = {0};
+      double start = now_seconds();
+      if (method == 0)
+        create_centroids(&centroids, k);
+      else
+        afkmc2_centroids(&centroids, &samples, k, AFKMC2_CHAIN_LENGTH);
+      seconds += now_seconds() - start;
+
+      assign_step(&centroids, &samples);
+      seed_inertia += inertia(&samples);
+      float time_between_updates = 1.0f;
+      run_kmeans(&centroids, &samples, &time_between_updates);
+      assign_step(&centroids, &samples);
+      final_inertia += inertia(&samples);
+      free(centroids.items);
+    }
+    printf("%-12s %12.6f %16.0f %16.0f\n", method == 0 ? "create" : "afk-mc2",
+           seconds / seeds, seed_inertia / seeds, final_inertia / seeds);
+  }
+
+  free(samples.items);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "scaling") == 0)
+  {
+    int threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    srand(42);
+    run_scaling(threads > 0 ? threads : 1, false);
+    run_scaling(threads > 0 ? threads : 1, true);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "seeding") == 0)
+  {
+    run_seeding();
+    return 0;
+  }
+
+  int cpu = 0;
+  const char *save_path = NULL;
+  const char *compare_path = NULL;
+  double threshold = 5.0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+      save_path = argv[++i];
+    else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+      compare_path = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else
+      cpu = atoi(argv[i]);
+  }
+
+  BenchResults baseline = {0};
+  if (compare_path != NULL && !load_baseline(compare_path, &baseline))
+    return 1;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    fprintf(stderr, "WARNING: Could not pin to cpu %d, timings will be noisier\n", cpu);
+#ifdef _OPENMP
+  omp_set_num_threads(1);
+#endif
+
+  flush_buffer = calloc(BENCH_FLUSH_SIZE, 1);
+  assert(flush_buffer != NULL && "Buy more RAM lol");
+  srand(42);
+
+  printf("%-40s %10s %10s\n", "cycles per element", "warm", "cold");
+  BenchResults results = {0};
+  run_benchmarks(&results);
+
+  int status = 0;
+  if (save_path != NULL && !save_baseline(save_path, &results))
+    status = 1;
+  if (compare_path != NULL)
+  {
+    int regressions = compare_baseline(&baseline, &results, threshold);
+    if (regressions > 0)
+    {
+      printf("%d benchmarks regressed by more than %.1f%%\n", regressions, threshold);
+      status = 1;
+    }
+  }
+
+  free(baseline.items);
+  free(results.items);
+  free(flush_buffer);
+  return status;
+}
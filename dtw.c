@@ -0,0 +1,400 @@
+/*
+https://en.wikipedia.org/wiki/Dynamic_time_warping
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include "dtw.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define INITIAL_CAPACITY 10
+#define MAX_ITERATIONS 300
+#define EPSILON 0.0001f
+
+//--------------------------------------------------
+// Prepares an empty set of series with the given length
+//--------------------------------------------------
+void series_init(Series *s, int length)
+{
+  memset(s, 0, sizeof(*s));
+  s->length = length;
+}
+
+//--------------------------------------------------
+// Appends a series of s->length values
+//--------------------------------------------------
+void series_append(Series *s, const float *values)
+{
+  if (s->count >= s->capacity)
+  {
+    s->capacity = s->capacity == 0 ? INITIAL_CAPACITY : s->capacity * 2;
+    s->items = realloc(s->items, (size_t)s->capacity * s->length * sizeof(float));
+    s->clusters = realloc(s->clusters, s->capacity * sizeof(int));
+    assert(s->items != NULL && s->clusters != NULL && "Buy more RAM lol");
+  }
+  memcpy(&s->items[(size_t)s->count * s->length], values, s->length * sizeof(float));
+  s->clusters[s->count++] = -1;
+}
+
+void series_free(Series *s)
+{
+  free(s->items);
+  free(s->clusters);
+  memset(s, 0, sizeof(*s));
+}
+
+//--------------------------------------------------
+// Squared DTW distance restricted to a band of +-window steps.
+// Gives up and returns __FLT_MAX__ as soon as a whole row exceeds bound.
+// rows must hold 2 * (length + 1) floats and is reused between calls,
+// only the cells around the band are reset
+//--------------------------------------------------
+float dtw_distance(const float *a, const float *b, int length, int window, float bound, float *rows)
+{
+  float *previous = rows;
+  float *current = rows + length + 1;
+
+  int reach = window + 1 < length ? window + 1 : length;
+  for (int j = 1; j <= reach; j++)
+    previous[j] = __FLT_MAX__;
+  previous[0] = 0.0f;
+
+  for (int i = 1; i <= length; i++)
+  {
+    int from = i - window > 1 ? i - window : 1;
+    int to = i + window < length ? i + window : length;
+    float row_min = __FLT_MAX__;
+    // The next row reads at most one cell past either end of this band
+    current[from - 1] = __FLT_MAX__;
+    if (to < length)
+      current[to + 1] = __FLT_MAX__;
+    for (int j = from; j <= to; j++)
+    {
+      float diff = a[i - 1] - b[j - 1];
+      float best = previous[j - 1];
+      if (previous[j] < best)
+        best = previous[j];
+      if (current[j - 1] < best)
+        best = current[j - 1];
+      current[j] = best + diff * diff;
+      if (current[j] < row_min)
+        row_min = current[j];
+    }
+    if (row_min >= bound)
+      return __FLT_MAX__;
+    float *tmp = previous;
+    previous = current;
+    current = tmp;
+  }
+
+  return previous[length];
+}
+
+//--------------------------------------------------
+// LB_Kim: first and last points must always be aligned
+//--------------------------------------------------
+float lb_kim(const float *a, const float *b, int length)
+{
+  float first = a[0] - b[0];
+  float last = a[length - 1] - b[length - 1];
+  return length > 1 ? first * first + last * last : first * first;
+}
+
+//--------------------------------------------------
+// LB_Keogh: distance from a series to the envelope of a centroid,
+// abandoned once it exceeds bound
+//--------------------------------------------------
+float lb_keogh(const float *a, const float *upper, const float *lower, int length, float bound)
+{
+  float sum = 0.0f;
+  for (int t = 0; t < length && sum < bound; t++)
+  {
+    if (a[t] > upper[t])
+      sum += (a[t] - upper[t]) * (a[t] - upper[t]);
+    else if (a[t] < lower[t])
+      sum += (a[t] - lower[t]) * (a[t] - lower[t]);
+  }
+  return sum;
+}
+
+//--------------------------------------------------
+// Upper and lower envelopes of a series over +-window steps
+//--------------------------------------------------
+void envelope(const float *a, int length, int window, float *upper, float *lower)
+{
+  for (int t = 0; t < length; t++)
+  {
+    int from = t - window > 0 ? t - window : 0;
+    int to = t + window < length - 1 ? t + window : length - 1;
+    upper[t] = lower[t] = a[from];
+    for (int u = from + 1; u <= to; u++)
+    {
+      if (a[u] > upper[t])
+        upper[t] = a[u];
+      if (a[u] < lower[t])
+        lower[t] = a[u];
+    }
+  }
+}
+
+//--------------------------------------------------
+// Uses k randomly picked series as initial centroids
+//--------------------------------------------------
+void create_series_centroids(SeriesCentroids *c, Series *s, int k)
+{
+  c->length = s->length;
+  c->count = k;
+  c->items = malloc((size_t)k * s->length * sizeof(float));
+  assert(c->items != NULL && "Buy more RAM lol");
+  for (int i = 0; i < k; i++)
+  {
+    int pick = rand() % s->count;
+    memcpy(&c->items[(size_t)i * c->length], &s->items[(size_t)pick * s->length],
+           s->length * sizeof(float));
+  }
+}
+
+//--------------------------------------------------
+// Assigns each series to the centroid with the smallest DTW distance.
+// The current centroid is tried first so the bound is tight early, then
+// LB_Kim and LB_Keogh skip centroids that cannot beat it and the DTW
+// itself is abandoned once it does. Returns the number of full DTW runs
+//--------------------------------------------------
+long dtw_assign_step(SeriesCentroids *c, Series *s, int window)
+{
+  int length = s->length;
+  float *upper = malloc((size_t)c->count * length * sizeof(float));
+  float *lower = malloc((size_t)c->count * length * sizeof(float));
+  if (upper == NULL || lower == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for envelopes on dtw_assign_step method\n");
+    free(upper);
+    free(lower);
+    return 0;
+  }
+  for (int k = 0; k < c->count; k++)
+    envelope(&c->items[(size_t)k * length], length, window,
+             &upper[(size_t)k * length], &lower[(size_t)k * length]);
+
+  long computed = 0;
+#pragma omp parallel reduction(+ : computed)
+  {
+    float *rows = malloc(2 * ((size_t)length + 1) * sizeof(float));
+    assert(rows != NULL && "Buy more RAM lol");
+
+#pragma omp for schedule(dynamic, 16)
+    for (int i = 0; i < s->count; i++)
+    {
+      const float *series = &s->items[(size_t)i * length];
+      int best_cluster = s->clusters[i];
+      float best_distance = __FLT_MAX__;
+      if (best_cluster >= 0)
+      {
+        best_distance = dtw_distance(series, &c->items[(size_t)best_cluster * length], length, window, __FLT_MAX__, rows);
+        computed++;
+      }
+
+      for (int k = 0; k < c->count; k++)
+      {
+        const float *centroid = &c->items[(size_t)k * length];
+        if (k == s->clusters[i])
+          continue;
+        if (lb_kim(series, centroid, length) >= best_distance)
+          continue;
+        if (lb_keogh(series, &upper[(size_t)k * length], &lower[(size_t)k * length], length, best_distance) >= best_distance)
+          continue;
+        float distance = dtw_distance(series, centroid, length, window, best_distance, rows);
+        computed++;
+        if (distance < best_distance)
+        {
+          best_distance = distance;
+          best_cluster = k;
+        }
+      }
+      s->clusters[i] = best_cluster;
+    }
+
+    free(rows);
+  }
+
+  free(upper);
+  free(lower);
+  return computed;
+}
+
+//--------------------------------------------------
+// Aligns a series with a centroid and adds every series point to the
+// sums of the centroid points it is warped onto.
+// cost must hold length * length floats
+//--------------------------------------------------
+void dba_accumulate(const float *series, const float *centroid, int length, int window,
+                    float *cost, double *sums, int *counts)
+{
+  for (int i = 0; i < length; i++)
+  {
+    for (int j = 0; j < length; j++)
+    {
+      float *cell = &cost[(size_t)i * length + j];
+      if (j < i - window || j > i + window)
+      {
+        *cell = __FLT_MAX__;
+        continue;
+      }
+      float diff = series[i] - centroid[j];
+      float best;
+      if (i == 0 && j == 0)
+        best = 0.0f;
+      else
+      {
+        best = __FLT_MAX__;
+        if (i > 0 && j > 0 && cost[(size_t)(i - 1) * length + j - 1] < best)
+          best = cost[(size_t)(i - 1) * length + j - 1];
+        if (i > 0 && cost[(size_t)(i - 1) * length + j] < best)
+          best = cost[(size_t)(i - 1) * length + j];
+        if (j > 0 && cost[(size_t)i * length + j - 1] < best)
+          best = cost[(size_t)i * length + j - 1];
+      }
+      *cell = best + diff * diff;
+    }
+  }
+
+  int i = length - 1;
+  int j = length - 1;
+  while (true)
+  {
+    sums[j] += series[i];
+    counts[j]++;
+    if (i == 0 && j == 0)
+      break;
+    if (i == 0)
+      j--;
+    else if (j == 0)
+      i--;
+    else
+    {
+      float diagonal = cost[(size_t)(i - 1) * length + j - 1];
+      float up = cost[(size_t)(i - 1) * length + j];
+      float left = cost[(size_t)i * length + j - 1];
+      if (diagonal <= up && diagonal <= left)
+      {
+        i--;
+        j--;
+      }
+      else if (up <= left)
+        i--;
+      else
+        j--;
+    }
+  }
+}
+
+//--------------------------------------------------
+// One DBA iteration: every centroid point becomes the mean of the
+// series points aligned to it. Threads keep private sums merged in
+// thread order at the end, so a given thread count always gives the
+// same centroids. Empty clusters keep their centroid
+//--------------------------------------------------
+void dba_update_step(SeriesCentroids *c, Series *s, int window)
+{
+  int length = s->length;
+  size_t size = (size_t)c->count * length;
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  double *sums = calloc(size, sizeof(double));
+  int *counts = calloc(size, sizeof(int));
+  double **partial_sums = calloc(threads, sizeof(double *));
+  int **partial_counts = calloc(threads, sizeof(int *));
+  if (sums == NULL || counts == NULL || partial_sums == NULL || partial_counts == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for sums on dba_update_step method\n");
+    free(sums);
+    free(counts);
+    free(partial_sums);
+    free(partial_counts);
+    return;
+  }
+
+#pragma omp parallel
+  {
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    double *local_sums = calloc(size, sizeof(double));
+    int *local_counts = calloc(size, sizeof(int));
+    float *cost = malloc((size_t)length * length * sizeof(float));
+    assert(local_sums != NULL && local_counts != NULL && cost != NULL && "Buy more RAM lol");
+    partial_sums[thread] = local_sums;
+    partial_counts[thread] = local_counts;
+
+    // Every alignment costs length * length, and a static split keeps the
+    // series each thread sums, and so the merged result, the same every run
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < s->count; i++)
+    {
+      int k = s->clusters[i];
+      dba_accumulate(&s->items[(size_t)i * length], &c->items[(size_t)k * length], length, window,
+                     cost, &local_sums[(size_t)k * length], &local_counts[(size_t)k * length]);
+    }
+    free(cost);
+  }
+
+  for (int t = 0; t < threads; t++)
+  {
+    if (partial_sums[t] == NULL)
+      continue;
+    for (size_t j = 0; j < size; j++)
+    {
+      sums[j] += partial_sums[t][j];
+      counts[j] += partial_counts[t][j];
+    }
+    free(partial_sums[t]);
+    free(partial_counts[t]);
+  }
+  free(partial_sums);
+  free(partial_counts);
+
+  for (size_t j = 0; j < size; j++)
+    if (counts[j] > 0)
+      c->items[j] = sums[j] / counts[j];
+
+  free(sums);
+  free(counts);
+}
+
+//--------------------------------------------------
+// Run DTW k-means until centroids stop moving
+//--------------------------------------------------
+void run_dtw_kmeans(SeriesCentroids *c, Series *s, int window)
+{
+  size_t size = (size_t)c->count * c->length;
+  float *previous = malloc(size * sizeof(float));
+  if (previous == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for previous on run_dtw_kmeans method\n");
+    return;
+  }
+
+  for (int iteration = 0; iteration < MAX_ITERATIONS; iteration++)
+  {
+    memcpy(previous, c->items, size * sizeof(float));
+    dtw_assign_step(c, s, window);
+    dba_update_step(c, s, window);
+
+    bool moved = false;
+    for (size_t j = 0; j < size && !moved; j++)
+      moved = (previous[j] - c->items[j]) * (previous[j] - c->items[j]) > EPSILON;
+    if (!moved)
+      break;
+  }
+
+  free(previous);
+}
@@ -0,0 +1,34 @@
+/*
+Time-series k-means with dynamic time warping as distance and DTW
+barycenter averaging (DBA) as centroid update
+*/
+
+#ifndef DTW_H
+#define DTW_H
+
+typedef struct
+{
+  float *items; // Series i uses items[i * length] .. items[(i + 1) * length - 1]
+  int *clusters;
+  int length;
+  int count;
+  int capacity;
+} Series;
+
+typedef struct
+{
+  float *items;
+  int length;
+  int count;
+} SeriesCentroids;
+
+void series_init(Series *s, int length);
+void series_append(Series *s, const float *values);
+void series_free(Series *s);
+float dtw_distance(const float *a, const float *b, int length, int window, float bound, float *rows);
+void create_series_centroids(SeriesCentroids *c, Series *s, int k);
+long dtw_assign_step(SeriesCentroids *c, Series *s, int window);
+void dba_update_step(SeriesCentroids *c, Series *s, int window);
+void run_dtw_kmeans(SeriesCentroids *c, Series *s, int window);
+
+#endif
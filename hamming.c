@@ -0,0 +1,259 @@
+/*
+https://en.wikipedia.org/wiki/Hamming_distance
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "hamming.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define INITIAL_CAPACITY 10
+#define MAX_ITERATIONS 300
+
+//--------------------------------------------------
+// Prepares an empty set of samples with the given number of bits
+//--------------------------------------------------
+void binary_samples_init(BinarySamples *s, int bits)
+{
+  memset(s, 0, sizeof(*s));
+  s->words = (bits + 63) / 64;
+}
+
+//--------------------------------------------------
+// Appends a sample of s->words packed words
+//--------------------------------------------------
+void binary_samples_append(BinarySamples *s, const uint64_t *bits)
+{
+  if (s->count >= s->capacity)
+  {
+    s->capacity = s->capacity == 0 ? INITIAL_CAPACITY : s->capacity * 2;
+    s->items = realloc(s->items, (size_t)s->capacity * s->words * sizeof(uint64_t));
+    s->clusters = realloc(s->clusters, s->capacity * sizeof(int));
+    assert(s->items != NULL && s->clusters != NULL && "Buy more RAM lol");
+  }
+  memcpy(&s->items[(size_t)s->count * s->words], bits, s->words * sizeof(uint64_t));
+  s->clusters[s->count++] = -1;
+}
+
+void binary_samples_free(BinarySamples *s)
+{
+  free(s->items);
+  free(s->clusters);
+  memset(s, 0, sizeof(*s));
+}
+
+//--------------------------------------------------
+// Portable XOR-popcount kernel
+//--------------------------------------------------
+int hamming_distance_scalar(const uint64_t *a, const uint64_t *b, int words)
+{
+  int distance = 0;
+  for (int w = 0; w < words; w++)
+    distance += __builtin_popcountll(a[w] ^ b[w]);
+  return distance;
+}
+
+#if defined(__x86_64__)
+//--------------------------------------------------
+// Same kernel built for the POPCNT instruction, without it the compiler
+// calls a library routine for every word
+//--------------------------------------------------
+__attribute__((target("popcnt"))) int hamming_distance_popcnt(const uint64_t *a, const uint64_t *b, int words)
+{
+  int distance = 0;
+  for (int w = 0; w < words; w++)
+    distance += __builtin_popcountll(a[w] ^ b[w]);
+  return distance;
+}
+
+//--------------------------------------------------
+// XOR-popcount kernel counting 512 bits per instruction
+//--------------------------------------------------
+__attribute__((target("avx512f,avx512vpopcntdq"))) int hamming_distance_avx512(const uint64_t *a, const uint64_t *b, int words)
+{
+  __m512i sum = _mm512_setzero_si512();
+  int w = 0;
+  for (; w + 8 <= words; w += 8)
+  {
+    __m512i x = _mm512_xor_si512(_mm512_loadu_si512(&a[w]), _mm512_loadu_si512(&b[w]));
+    sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+  }
+  // The last words go through masked loads, so short samples stay vectorized
+  if (w < words)
+  {
+    __mmask8 mask = (__mmask8)((1u << (words - w)) - 1);
+    __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, &a[w]), _mm512_maskz_loadu_epi64(mask, &b[w]));
+    sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+  }
+  return (int)_mm512_reduce_add_epi64(sum);
+}
+#endif
+
+typedef int (*HammingKernel)(const uint64_t *a, const uint64_t *b, int words);
+
+HammingKernel hamming_kernel = hamming_distance_scalar;
+
+#if defined(__x86_64__)
+//--------------------------------------------------
+// Picks the fastest kernel the CPU supports. It runs once when the
+// program or module is loaded, before any thread exists, so the
+// parallel loops only ever read hamming_kernel
+//--------------------------------------------------
+__attribute__((constructor)) void select_hamming_kernel(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512vpopcntdq"))
+    hamming_kernel = hamming_distance_avx512;
+  else if (__builtin_cpu_supports("popcnt"))
+    hamming_kernel = hamming_distance_popcnt;
+}
+#endif
+
+//--------------------------------------------------
+// Number of differing bits, using AVX-512 VPOPCNTDQ or POPCNT when the
+// CPU has them
+//--------------------------------------------------
+int hamming_distance(const uint64_t *a, const uint64_t *b, int words)
+{
+  return hamming_kernel(a, b, words);
+}
+
+//--------------------------------------------------
+// Uses k randomly picked samples as initial centroids
+//--------------------------------------------------
+void create_binary_centroids(BinaryCentroids *c, BinarySamples *s, int k)
+{
+  c->words = s->words;
+  c->count = k;
+  c->items = malloc((size_t)k * s->words * sizeof(uint64_t));
+  assert(c->items != NULL && "Buy more RAM lol");
+  for (int i = 0; i < k; i++)
+  {
+    int pick = rand() % s->count;
+    memcpy(&c->items[(size_t)i * c->words], &s->items[(size_t)pick * s->words],
+           s->words * sizeof(uint64_t));
+  }
+}
+
+//--------------------------------------------------
+// Assigns each sample to the centroid with the fewest differing bits
+//--------------------------------------------------
+void hamming_assign_step(BinaryCentroids *c, BinarySamples *s)
+{
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < s->count; i++)
+  {
+    const uint64_t *sample = &s->items[(size_t)i * s->words];
+    int best_distance = __INT_MAX__;
+    for (int k = 0; k < c->count; k++)
+    {
+      int distance = hamming_distance(sample, &c->items[(size_t)k * c->words], s->words);
+      if (distance < best_distance)
+      {
+        best_distance = distance;
+        s->clusters[i] = k;
+      }
+    }
+  }
+}
+
+//--------------------------------------------------
+// Sets each centroid bit to the value held by most of its samples.
+// Every thread counts set bits in private counters which are merged
+// at the end. Ties and empty clusters keep the previous bit
+//--------------------------------------------------
+void majority_update_step(BinaryCentroids *c, BinarySamples *s)
+{
+  int bits = s->words * 64;
+  int *counts = calloc((size_t)c->count * bits, sizeof(int));
+  int *totals = calloc(c->count, sizeof(int));
+  if (counts == NULL || totals == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for counters on majority_update_step method\n");
+    free(counts);
+    free(totals);
+    return;
+  }
+
+#pragma omp parallel
+  {
+    int *local_counts = calloc((size_t)c->count * bits, sizeof(int));
+    int *local_totals = calloc(c->count, sizeof(int));
+    assert(local_counts != NULL && local_totals != NULL && "Buy more RAM lol");
+
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < s->count; i++)
+    {
+      const uint64_t *sample = &s->items[(size_t)i * s->words];
+      int *cluster_counts = &local_counts[(size_t)s->clusters[i] * bits];
+      local_totals[s->clusters[i]]++;
+      for (int w = 0; w < s->words; w++)
+      {
+        // Visit set bits only, fingerprints are usually sparse
+        uint64_t word = sample[w];
+        while (word)
+        {
+          cluster_counts[w * 64 + __builtin_ctzll(word)]++;
+          word &= word - 1;
+        }
+      }
+    }
+
+#pragma omp critical
+    {
+      for (size_t j = 0; j < (size_t)c->count * bits; j++)
+        counts[j] += local_counts[j];
+      for (int k = 0; k < c->count; k++)
+        totals[k] += local_totals[k];
+    }
+    free(local_counts);
+    free(local_totals);
+  }
+
+  for (int k = 0; k < c->count; k++)
+  {
+    uint64_t *centroid = &c->items[(size_t)k * c->words];
+    int *cluster_counts = &counts[(size_t)k * bits];
+    for (int b = 0; b < bits; b++)
+    {
+      uint64_t mask = 1ULL << (b % 64);
+      if (2 * cluster_counts[b] > totals[k])
+        centroid[b / 64] |= mask;
+      else if (2 * cluster_counts[b] < totals[k])
+        centroid[b / 64] &= ~mask;
+    }
+  }
+
+  free(counts);
+  free(totals);
+}
+
+//--------------------------------------------------
+// Run k-majority until centroids stop changing
+//--------------------------------------------------
+void run_kmajority(BinaryCentroids *c, BinarySamples *s)
+{
+  size_t size = (size_t)c->count * c->words * sizeof(uint64_t);
+  uint64_t *previous = malloc(size);
+  if (previous == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for previous on run_kmajority method\n");
+    return;
+  }
+
+  for (int iteration = 0; iteration < MAX_ITERATIONS; iteration++)
+  {
+    memcpy(previous, c->items, size);
+    hamming_assign_step(c, s);
+    majority_update_step(c, s);
+    if (memcmp(previous, c->items, size) == 0)
+      break;
+  }
+
+  free(previous);
+}
@@ -0,0 +1,37 @@
+/*
+Binary k-majority clustering: k-means over bit-packed samples using the
+Hamming distance and a per-bit majority vote as centroid update
+*/
+
+#ifndef HAMMING_H
+#define HAMMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+  uint64_t *items; // Sample i uses items[i * words] .. items[(i + 1) * words - 1]
+  int *clusters;
+  int words;
+  int count;
+  int capacity;
+} BinarySamples;
+
+typedef struct
+{
+  uint64_t *items;
+  int words;
+  int count;
+} BinaryCentroids;
+
+void binary_samples_init(BinarySamples *s, int bits);
+void binary_samples_append(BinarySamples *s, const uint64_t *bits);
+void binary_samples_free(BinarySamples *s);
+int hamming_distance(const uint64_t *a, const uint64_t *b, int words);
+void create_binary_centroids(BinaryCentroids *c, BinarySamples *s, int k);
+void hamming_assign_step(BinaryCentroids *c, BinarySamples *s);
+void majority_update_step(BinaryCentroids *c, BinarySamples *s);
+void run_kmajority(BinaryCentroids *c, BinarySamples *s);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+https://datatracker.ietf.org/doc/html/rfc1952
+https://datatracker.ietf.org/doc/html/rfc8878
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <zstd.h>
+#include "ingest.h"
+
+#define GZIP_CHUNK (1 << 20)
+#define ZSTD_MAX_RATIO 32768 // A 4 byte RLE block decodes to at most 128 KiB
+
+typedef struct
+{
+  size_t input_offset;
+  size_t input_size;
+  size_t output_offset;
+  size_t output_size;
+} Frame;
+
+//--------------------------------------------------
+// Maps a whole file read-only
+//--------------------------------------------------
+void *map_file(const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  void *data = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      data = NULL;
+    *size = st.st_size;
+  }
+  close(fd);
+  return data;
+}
+
+//--------------------------------------------------
+// Inflates a gzip file, including concatenated members.
+// Inflating is sequential, only the output buffer grows as needed
+//--------------------------------------------------
+void *load_gzip(const char *path, size_t *size)
+{
+  gzFile file = gzopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  gzbuffer(file, GZIP_CHUNK);
+
+  size_t capacity = GZIP_CHUNK;
+  size_t count = 0;
+  char *data = malloc(capacity);
+  while (data != NULL)
+  {
+    if (count == capacity)
+    {
+      capacity *= 2;
+      char *grown = realloc(data, capacity);
+      if (grown == NULL)
+      {
+        free(data);
+        data = NULL;
+        break;
+      }
+      data = grown;
+    }
+    unsigned int want = capacity - count > GZIP_CHUNK ? GZIP_CHUNK : capacity - count;
+    int got = gzread(file, data + count, want);
+    if (got < 0)
+    {
+      fprintf(stderr, "ERROR: Could not inflate %s\n", path);
+      free(data);
+      data = NULL;
+      break;
+    }
+    if (got == 0)
+      break;
+    count += got;
+  }
+
+  gzclose(file);
+  *size = count;
+  return data;
+}
+
+//--------------------------------------------------
+// Decompresses a zstd file. Frames are independent, so when every frame
+// records its content size they are decompressed in parallel straight to
+// their place in the output. Otherwise the file is streamed sequentially.
+// Content sizes no frame of that length could hold are rejected as corrupt
+//--------------------------------------------------
+void *load_zstd(const char *path, size_t *size)
+{
+  size_t input_size = 0;
+  const char *input = map_file(path, &input_size);
+  if (input == NULL)
+    return NULL;
+
+  int count = 0;
+  int capacity = 16;
+  Frame *frames = malloc(capacity * sizeof(Frame));
+  bool sized = frames != NULL;
+  bool corrupt = false;
+  size_t total = 0;
+  for (size_t offset = 0; sized && offset < input_size;)
+  {
+    size_t frame_size = ZSTD_findFrameCompressedSize(input + offset, input_size - offset);
+    unsigned long long content_size = ZSTD_getFrameContentSize(input + offset, input_size - offset);
+    if (ZSTD_isError(frame_size) || content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR)
+    {
+      sized = false;
+      break;
+    }
+    if (content_size / ZSTD_MAX_RATIO > frame_size || content_size > SIZE_MAX - total)
+    {
+      sized = false;
+      corrupt = true;
+      break;
+    }
+    if (count == capacity)
+    {
+      capacity *= 2;
+      Frame *grown = realloc(frames, capacity * sizeof(Frame));
+      if (grown == NULL)
+      {
+        sized = false;
+        break;
+      }
+      frames = grown;
+    }
+    frames[count++] = (Frame){offset, frame_size, total, content_size};
+    offset += frame_size;
+    total += content_size;
+  }
+
+  char *output = NULL;
+  if (sized)
+  {
+    output = malloc(total > 0 ? total : 1);
+    if (output != NULL)
+    {
+      bool failed = false;
+#pragma omp parallel for schedule(dynamic, 1) reduction(|| : failed)
+      for (int f = 0; f < count; f++)
+      {
+        size_t written = ZSTD_decompress(output + frames[f].output_offset, frames[f].output_size,
+                                         input + frames[f].input_offset, frames[f].input_size);
+        failed = failed || ZSTD_isError(written) || written != frames[f].output_size;
+      }
+      if (failed)
+      {
+        free(output);
+        output = NULL;
+      }
+    }
+    *size = total;
+  }
+  else if (!corrupt)
+  {
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    size_t capacity_out = ZSTD_DStreamOutSize();
+    output = malloc(capacity_out);
+    ZSTD_inBuffer in = {input, input_size, 0};
+    ZSTD_outBuffer out = {output, capacity_out, 0};
+    size_t remaining = 1; // Becomes 0 once a frame is fully decoded and flushed
+    while (stream != NULL && output != NULL && (in.pos < in.size || remaining != 0))
+    {
+      if (out.pos == out.size)
+      {
+        char *grown = realloc(output, out.size * 2);
+        if (grown == NULL)
+          break;
+        output = grown;
+        out.dst = output;
+        out.size *= 2;
+      }
+      size_t in_before = in.pos;
+      size_t out_before = out.pos;
+      remaining = ZSTD_decompressStream(stream, &out, &in);
+      if (ZSTD_isError(remaining) || (in.pos == in_before && out.pos == out_before))
+        break;
+    }
+    if (in.pos < in.size || remaining != 0)
+    {
+      free(output);
+      output = NULL;
+    }
+    ZSTD_freeDStream(stream);
+    *size = out.pos;
+  }
+
+  if (output == NULL)
+    fprintf(stderr, "ERROR: Could not decompress %s\n", path);
+  free(frames);
+  munmap((void *)input, input_size);
+  return output;
+}
+
+//--------------------------------------------------
+// Loads a dataset, mapping plain files and decompressing .gz and .zst
+// files into memory. mapped tells how free_dataset must release it
+//--------------------------------------------------
+void *load_dataset(const char *path, size_t *size, bool *mapped)
+{
+  size_t length = strlen(path);
+  *mapped = false;
+  if (length > 3 && strcmp(path + length - 3, ".gz") == 0)
+    return load_gzip(path, size);
+  if (length > 4 && strcmp(path + length - 4, ".zst") == 0)
+    return load_zstd(path, size);
+  *mapped = true;
+  return map_file(path, size);
+}
+
+//--------------------------------------------------
+// Size load_dataset will return, read without decompressing: the frame
+// content sizes of a .zst file and the ISIZE trailer of a .gz file, which
+// only holds the last member modulo 4 GiB. Returns 0 for missing files
+//--------------------------------------------------
+size_t dataset_size(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return 0;
+  size_t length = strlen(path);
+  if (length > 3 && strcmp(path + length - 3, ".gz") == 0)
+  {
+    unsigned char trailer[4];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+      return 0;
+    bool complete = fseek(file, -4, SEEK_END) == 0 && fread(trailer, 1, 4, file) == 4;
+    fclose(file);
+    if (!complete)
+      return 0;
+    size_t size = (size_t)trailer[0] | (size_t)trailer[1] << 8 | (size_t)trailer[2] << 16 | (size_t)trailer[3] << 24;
+    // Concatenated members and wrapped sizes make ISIZE too small, the
+    // compressed size is then the closer guess
+    return size > (size_t)st.st_size ? size : (size_t)st.st_size;
+  }
+  if (length > 4 && strcmp(path + length - 4, ".zst") == 0)
+  {
+    size_t input_size = 0;
+    const char *input = map_file(path, &input_size);
+    if (input == NULL)
+      return 0;
+    size_t total = 0;
+    for (size_t offset = 0; offset < input_size;)
+    {
+      size_t frame_size = ZSTD_findFrameCompressedSize(input + offset, input_size - offset);
+      unsigned long long content_size = ZSTD_getFrameContentSize(input + offset, input_size - offset);
+      if (ZSTD_isError(frame_size) || content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR ||
+          content_size / ZSTD_MAX_RATIO > frame_size || content_size > SIZE_MAX - total)
+      {
+        // Streamed and corrupt frames do not tell their size, the file size is all there is
+        total = input_size;
+        break;
+      }
+      offset += frame_size;
+      total += content_size;
+    }
+    munmap((void *)input, input_size);
+    return total;
+  }
+  return st.st_size;
+}
+
+void free_dataset(void *data, size_t size, bool mapped)
+{
+  if (mapped)
+    munmap(data, size);
+  else
+    free(data);
+}
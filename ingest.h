@@ -0,0 +1,16 @@
+/*
+Dataset loading for the batch runner: plain files are mapped, .gz and
+.zst files are decompressed straight into memory
+*/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void *load_dataset(const char *path, size_t *size, bool *mapped);
+size_t dataset_size(const char *path);
+void free_dataset(void *data, size_t size, bool mapped);
+
+#endif
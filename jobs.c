@@ -0,0 +1,185 @@
+/*
+https://en.wikipedia.org/wiki/Thread_pool
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "jobs.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define JOB_QUEUE_LIMIT 64 // Queued jobs before job_submit refuses new ones
+
+//--------------------------------------------------
+// Drops one reference to a job, the last one closes its eventfd and frees it
+//--------------------------------------------------
+void job_release(Job *job)
+{
+  if (atomic_fetch_sub(&job->references, 1) == 1)
+  {
+    close(job->fd);
+    free(job);
+  }
+}
+
+//--------------------------------------------------
+// Worker thread of a JobPool. Takes jobs in submission order until the
+// pool is stopped and the queue is empty
+//--------------------------------------------------
+void *job_worker(void *arg)
+{
+  JobPool *pool = arg;
+#ifdef _OPENMP
+  omp_set_num_threads(pool->threads);
+#endif
+  for (;;)
+  {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->stopping)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    Job *job = pool->head;
+    if (job == NULL)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pool->head = job->next;
+    if (pool->head == NULL)
+      pool->tail = NULL;
+    pool->pending--;
+    pthread_mutex_unlock(&pool->lock);
+
+    job->run(job->arg);
+    if (job->callback != NULL)
+      job->callback(job, job->user_data);
+    atomic_store(&job->done, true);
+    eventfd_write(job->fd, 1);
+    job_release(job);
+  }
+}
+
+//--------------------------------------------------
+// Starts a pool of workers running jobs in the background. The cores
+// are split between the workers so concurrent jobs do not oversubscribe
+// them, and every job gets at least one thread when workers outnumber cores
+//--------------------------------------------------
+bool job_pool_start(JobPool *pool, int workers)
+{
+  *pool = (JobPool){0};
+  if (workers < 1)
+  {
+    fprintf(stderr, "ERROR: A pool needs at least one worker on job_pool_start method\n");
+    return false;
+  }
+  pool->workers = malloc(workers * sizeof(pthread_t));
+  if (pool->workers == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't allocate memory for the workers on job_pool_start method\n");
+    return false;
+  }
+  pool->threads = 1;
+#ifdef _OPENMP
+  pool->threads = omp_get_num_procs() / workers;
+  if (pool->threads < 1)
+    pool->threads = 1;
+#endif
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+
+  for (pool->count = 0; pool->count < workers; pool->count++)
+    if (pthread_create(&pool->workers[pool->count], NULL, job_worker, pool) != 0)
+      break;
+  if (pool->count == 0)
+  {
+    fprintf(stderr, "ERROR: Can't start any worker on job_pool_start method\n");
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->workers);
+    pool->workers = NULL;
+    return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------
+// Queues run(arg) and returns at once. arg must stay valid until the job
+// is done, which is signalled by the callback, by job->fd becoming
+// readable and by job_done.
+// Returns NULL when JOB_QUEUE_LIMIT jobs are already waiting
+//--------------------------------------------------
+Job *job_submit(JobPool *pool, JobRun run, void *arg, JobCallback callback, void *user_data)
+{
+  Job *job = malloc(sizeof(Job));
+  if (job == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't allocate memory for the job on job_submit method\n");
+    return NULL;
+  }
+  job->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (job->fd < 0)
+  {
+    fprintf(stderr, "ERROR: Can't create the eventfd on job_submit method\n");
+    free(job);
+    return NULL;
+  }
+  job->run = run;
+  job->arg = arg;
+  job->callback = callback;
+  job->user_data = user_data;
+  job->next = NULL;
+  atomic_init(&job->done, false);
+  atomic_init(&job->references, 2);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->pending >= JOB_QUEUE_LIMIT || pool->stopping)
+  {
+    pthread_mutex_unlock(&pool->lock);
+    close(job->fd);
+    free(job);
+    return NULL;
+  }
+  if (pool->tail != NULL)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pool->pending++;
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
+
+bool job_done(Job *job)
+{
+  return atomic_load(&job->done);
+}
+
+//--------------------------------------------------
+// Gives the job handle back. It may be called before the job is done,
+// the worker then frees it once it finishes
+//--------------------------------------------------
+void job_free(Job *job)
+{
+  job_release(job);
+}
+
+//--------------------------------------------------
+// Runs the queued jobs to completion and stops the workers
+//--------------------------------------------------
+void job_pool_stop(JobPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->count; i++)
+    pthread_join(pool->workers[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->ready);
+  free(pool->workers);
+}
@@ -0,0 +1,49 @@
+/*
+Pool of worker threads running jobs in the background. A job is done
+when its callback has run, its eventfd is readable and job_done says so,
+so it fits callback, event-loop and polling programs alike
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+typedef struct Job Job;
+typedef void (*JobRun)(void *arg);
+typedef void (*JobCallback)(Job *job, void *user_data);
+
+struct Job
+{
+  JobRun run;
+  void *arg;
+  JobCallback callback; // Called on the worker thread when the job is done
+  void *user_data;
+  int fd;               // eventfd that becomes readable when the job is done
+  atomic_bool done;
+  atomic_int references; // Owner and worker, the last one frees the job
+  Job *next;
+};
+
+typedef struct
+{
+  pthread_t *workers;
+  int count;
+  int threads; // OpenMP threads each job may use
+  int pending;
+  Job *head;
+  Job *tail;
+  bool stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} JobPool;
+
+bool job_pool_start(JobPool *pool, int workers);
+Job *job_submit(JobPool *pool, JobRun run, void *arg, JobCallback callback, void *user_data);
+bool job_done(Job *job);
+void job_free(Job *job);
+void job_pool_stop(JobPool *pool);
+
+#endif
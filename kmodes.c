@@ -0,0 +1,173 @@
+/*
+https://en.wikipedia.org/wiki/K-modes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "kmodes.h"
+
+#define INITIAL_CAPACITY 10
+#define MAX_ITERATIONS 300
+
+//--------------------------------------------------
+// Prepares an empty set of samples with the given number of attributes
+//--------------------------------------------------
+void categorical_samples_init(CategoricalSamples *s, int attributes)
+{
+  memset(s, 0, sizeof(*s));
+  s->attributes = attributes;
+}
+
+//--------------------------------------------------
+// Appends a sample of s->attributes category codes
+//--------------------------------------------------
+void categorical_samples_append(CategoricalSamples *s, const uint8_t *codes)
+{
+  if (s->count >= s->capacity)
+  {
+    s->capacity = s->capacity == 0 ? INITIAL_CAPACITY : s->capacity * 2;
+    s->items = realloc(s->items, (size_t)s->capacity * s->attributes);
+    s->clusters = realloc(s->clusters, s->capacity * sizeof(int));
+    assert(s->items != NULL && s->clusters != NULL && "Buy more RAM lol");
+  }
+  memcpy(&s->items[(size_t)s->count * s->attributes], codes, s->attributes);
+  s->clusters[s->count++] = -1;
+}
+
+void categorical_samples_free(CategoricalSamples *s)
+{
+  free(s->items);
+  free(s->clusters);
+  memset(s, 0, sizeof(*s));
+}
+
+//--------------------------------------------------
+// Number of attributes with different categories.
+// Byte compares let the compiler check a full vector per instruction
+//--------------------------------------------------
+int mismatch_distance(const uint8_t *a, const uint8_t *b, int attributes)
+{
+  int distance = 0;
+#pragma omp simd reduction(+ : distance)
+  for (int j = 0; j < attributes; j++)
+    distance += a[j] != b[j];
+  return distance;
+}
+
+//--------------------------------------------------
+// Uses k randomly picked samples as initial modes
+//--------------------------------------------------
+void create_modes(Modes *m, CategoricalSamples *s, int k)
+{
+  m->attributes = s->attributes;
+  m->count = k;
+  m->items = malloc((size_t)k * s->attributes);
+  assert(m->items != NULL && "Buy more RAM lol");
+  for (int i = 0; i < k; i++)
+  {
+    int pick = rand() % s->count;
+    memcpy(&m->items[(size_t)i * m->attributes], &s->items[(size_t)pick * s->attributes],
+           s->attributes);
+  }
+}
+
+//--------------------------------------------------
+// Assigns each sample to the mode with the fewest mismatches
+//--------------------------------------------------
+void kmodes_assign_step(Modes *m, CategoricalSamples *s)
+{
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < s->count; i++)
+  {
+    const uint8_t *sample = &s->items[(size_t)i * s->attributes];
+    int best_distance = __INT_MAX__;
+    for (int k = 0; k < m->count; k++)
+    {
+      int distance = mismatch_distance(sample, &m->items[(size_t)k * m->attributes], s->attributes);
+      if (distance < best_distance)
+      {
+        best_distance = distance;
+        s->clusters[i] = k;
+      }
+    }
+  }
+}
+
+//--------------------------------------------------
+// Sets every attribute of a mode to the most frequent category of its
+// samples. Each thread fills private frequency tables which are merged
+// at the end. Ties and empty clusters keep the current category
+//--------------------------------------------------
+void kmodes_update_step(Modes *m, CategoricalSamples *s)
+{
+  size_t table_size = (size_t)m->count * m->attributes * KMODES_CATEGORIES;
+  int *frequencies = calloc(table_size, sizeof(int));
+  if (frequencies == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for frequencies on kmodes_update_step method\n");
+    return;
+  }
+
+#pragma omp parallel
+  {
+    int *local = calloc(table_size, sizeof(int));
+    assert(local != NULL && "Buy more RAM lol");
+
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < s->count; i++)
+    {
+      const uint8_t *sample = &s->items[(size_t)i * s->attributes];
+      int *table = &local[(size_t)s->clusters[i] * s->attributes * KMODES_CATEGORIES];
+      for (int j = 0; j < s->attributes; j++)
+        table[j * KMODES_CATEGORIES + sample[j]]++;
+    }
+
+#pragma omp critical
+    for (size_t j = 0; j < table_size; j++)
+      frequencies[j] += local[j];
+    free(local);
+  }
+
+  for (int k = 0; k < m->count; k++)
+  {
+    uint8_t *mode = &m->items[(size_t)k * m->attributes];
+    for (int j = 0; j < m->attributes; j++)
+    {
+      int *table = &frequencies[((size_t)k * m->attributes + j) * KMODES_CATEGORIES];
+      int best = mode[j];
+      for (int c = 0; c < KMODES_CATEGORIES; c++)
+        if (table[c] > table[best])
+          best = c;
+      mode[j] = best;
+    }
+  }
+
+  free(frequencies);
+}
+
+//--------------------------------------------------
+// Run k-modes until modes stop changing
+//--------------------------------------------------
+void run_kmodes(Modes *m, CategoricalSamples *s)
+{
+  size_t size = (size_t)m->count * m->attributes;
+  uint8_t *previous = malloc(size);
+  if (previous == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for previous on run_kmodes method\n");
+    return;
+  }
+
+  for (int iteration = 0; iteration < MAX_ITERATIONS; iteration++)
+  {
+    memcpy(previous, m->items, size);
+    kmodes_assign_step(m, s);
+    kmodes_update_step(m, s);
+    if (memcmp(previous, m->items, size) == 0)
+      break;
+  }
+
+  free(previous);
+}
@@ -0,0 +1,38 @@
+/*
+k-modes clustering for categorical samples: k-means with the number of
+mismatching attributes as distance and per-attribute modes as centroids
+*/
+
+#ifndef KMODES_H
+#define KMODES_H
+
+#include <stdint.h>
+
+#define KMODES_CATEGORIES 256 // Each attribute is coded as 0..255
+
+typedef struct
+{
+  uint8_t *items; // Sample i uses items[i * attributes] .. items[(i + 1) * attributes - 1]
+  int *clusters;
+  int attributes;
+  int count;
+  int capacity;
+} CategoricalSamples;
+
+typedef struct
+{
+  uint8_t *items;
+  int attributes;
+  int count;
+} Modes;
+
+void categorical_samples_init(CategoricalSamples *s, int attributes);
+void categorical_samples_append(CategoricalSamples *s, const uint8_t *codes);
+void categorical_samples_free(CategoricalSamples *s);
+int mismatch_distance(const uint8_t *a, const uint8_t *b, int attributes);
+void create_modes(Modes *m, CategoricalSamples *s, int k);
+void kmodes_assign_step(Modes *m, CategoricalSamples *s);
+void kmodes_update_step(Modes *m, CategoricalSamples *s);
+void run_kmodes(Modes *m, CategoricalSamples *s);
+
+#endif
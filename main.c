@@ -9,6 +9,16 @@ https://en.wikipedia.org/wiki/K-means_clustering
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include "jobs.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define da_append(array, item)                                               \
   do                                                                         \
@@ -31,6 +41,35 @@ https://en.wikipedia.org/wiki/K-means_clustering
 #define SAMPLE_COLOR RED
 #define CENTROID_RADIUS 10
 #define CENTROID_COLOR BLACK
+#define TRIM_ALPHA 0.0f // Fraction of farthest samples ignored by update_step
+#define TRIM_BINS 1024
+#define KMEANS_ENGINE ENGINE_LLOYD // Assignment used by run_kmeans, see Engine
+#define ASSIGN_CHUNK 1024          // Samples per scheduling chunk of the assignment
+#define COST_LLOYD_NS 3.0          // Nanoseconds per sample-centroid pair, see ./bench
+#define COST_PARTIAL_NS 1.6
+#define COST_MIXED_NS 2.0
+#define MIXED_TOLERANCE (8 * __FLT_EPSILON__) // Relative error bound of float squared distances
+#define COST_THREAD_NS 20000.0     // Cost of one more thread per assignment
+#define AUTO_TRIAL_SAMPLES 20000   // Subsample size of the ENGINE_AUTO timed trial
+#define AUTO_TRIAL_MIN_WORK 1000000 // Below this n * k the cost model decides alone
+#define CANDIDATE_COUNT 4       // Nearest centroids remembered per sample by ENGINE_CANDIDATES
+#define CANDIDATE_REFRESH 5     // Iterations between full assignments
+#define CANDIDATE_DRIFT 0.5f    // Centroid movement, relative to the RMS sample distance, forcing a full assignment
+#define BALANCE_CANDIDATES 3    // Nearest centroids a sample may bid for
+#define BALANCE_SLACK 0.1f      // Extra room over n / k allowed per cluster
+#define BALANCE_MAX_BIDS 64     // Bids per sample before the auction gives up
+#define MAX_ITERATIONS 300
+#define OVER_RELAXATION false // Extrapolate centroid updates in run_kmeans
+#define RELAXATION_GROWTH 1.5f
+#define RELAXATION_MAX 4.0f
+#define STABILITY_RUNS 0 // Bootstrap resamples per k, 0 disables the analysis
+#define STABILITY_MAX_K 6
+#define AFKMC2_SEEDING false  // Seed centroids from the samples with afkmc2_centroids
+#define AFKMC2_CHAIN_LENGTH 200 // Markov chain steps per centroid
+#define DEDUPLICATE false // Merge identical samples into weighted ones before clustering
+#define DEDUP_EMPTY UINT64_MAX
+#define METRICS_FILE "" // node-exporter textfile written by run_kmeans, empty disables it
+#define METRICS_INTERVAL 5 // Seconds between METRICS_FILE writes
 
 typedef struct
 {
@@ -44,6 +83,8 @@ typedef struct
   float x;
   float y;
   int cluster;
+  float distance; // Distance to its centroid, filled by assign_step
+  int weight;     // Number of identical samples this one stands for
 } Sample;
 
 typedef struct
@@ -60,12 +101,104 @@ typedef struct
   int capacity;
 } Centroids;
 
+typedef struct
+{
+  float value;
+  int sample;
+} Bid;
+
+typedef struct
+{
+  Bid *items;
+  int count;
+  int capacity;
+} Bids;
+
+typedef struct
+{
+  float distance;
+  int weight;
+} WeightedDistance;
+
+typedef enum
+{
+  ENGINE_LLOYD,      // assign_step
+  ENGINE_PARTIAL,    // partial_assign_step
+  ENGINE_BALANCED,   // balanced_assign_step
+  ENGINE_MIXED,      // mixed_assign_step
+  ENGINE_CANDIDATES, // candidate_assign_step, approximate
+  ENGINE_AUTO,       // Fastest of lloyd, partial and mixed, see choose_plan
+} Engine;
+
+typedef struct
+{
+  Engine engine;
+  int threads;
+  int chunk;
+  double predicted; // Seconds per assignment
+  bool trial;       // Decided by a timed trial rather than the model alone
+} EnginePlan;
+
+typedef struct
+{
+  int *items;      // Nearest centroids of each sample, per_sample of them
+  int per_sample;
+  int count;       // Samples the lists were built for
+  Vector2 *anchor; // Centroids at the last full assignment
+  float spread;    // RMS distance of the samples to their centroid then
+  int since_refresh;
+  int refreshes;
+  double disagreement; // Fraction of labels the lists got wrong at the last full assignment
+} Candidates;
+
+typedef struct
+{
+  long runs;
+  long iteration;
+  int samples;
+  int clusters;
+  Engine engine;
+  double inertia;
+  double points_per_second;
+  double assign_seconds; // Phases of the last iteration
+  double trim_seconds;
+  double update_seconds;
+  double assign_total; // Phases summed over every iteration of every run
+  double trim_total;
+  double update_total;
+} Metrics;
+
+typedef struct
+{
+  Centroids *centroids;
+  Samples *samples;
+} KmeansArgs;
+
 Color centroids_colors[] = {
     RED,
     GREEN,
     YELLOW
 };
 
+const char *engine_names[] = {"lloyd", "partial", "balanced", "mixed", "candidates", "auto"};
+
+// Per thread, so jobs running at the same time do not share their plan
+_Thread_local int assign_chunk = ASSIGN_CHUNK;
+_Thread_local EnginePlan last_plan = {0};
+
+// Published by run_kmeans under metrics_sequence, read by metrics_worker
+Metrics metrics = {0};
+atomic_uint metrics_sequence = 0;
+atomic_flag metrics_writer = ATOMIC_FLAG_INIT;
+volatile sig_atomic_t metrics_dump_requested = 0;
+
+// Process-wide counters. Every run adds to them, so they keep growing
+// across runs and concurrent jobs instead of restarting with each snapshot
+atomic_long metrics_runs = 0;
+atomic_llong metrics_assign_nanoseconds = 0;
+atomic_llong metrics_trim_nanoseconds = 0;
+atomic_llong metrics_update_nanoseconds = 0;
+
 //--------------------------------------------------
 // Helper function to generate random float between min and max
 //--------------------------------------------------
@@ -85,6 +218,7 @@ void generate_samples(Samples *s, Vector2 center, size_t num_samples, double rad
     next_sample.x = center.x + get_random_float(-radius, radius);
     next_sample.y = center.y + get_random_float(-radius, radius);
     next_sample.cluster = -1; // We don't know the centroid to which it belongs yet
+    next_sample.weight = 1;
     da_append(s, next_sample);
   }
 }
@@ -125,6 +259,115 @@ void create_centroids(Centroids *c, int k)
   }
 }
 
+//--------------------------------------------------
+// Index of the first entry of an increasing cumulative array above value
+//--------------------------------------------------
+int upper_bound(const double *cumulative, int count, double value)
+{
+  int left = 0;
+  int right = count - 1;
+  while (left < right)
+  {
+    int middle = left + (right - left) / 2;
+    if (cumulative[middle] > value)
+      right = middle;
+    else
+      left = middle + 1;
+  }
+  return left;
+}
+
+//--------------------------------------------------
+// Squared distance from a sample to the closest of the first k centroids
+//--------------------------------------------------
+float closest_squared_distance(Centroids *c, int k, Sample *sample)
+{
+  float best = __FLT_MAX__;
+  for (int j = 0; j < k; j++)
+  {
+    float distance = (sample->x - c->items[j].x) * (sample->x - c->items[j].x) + (sample->y - c->items[j].y) * (sample->y - c->items[j].y);
+    if (distance < best)
+      best = distance;
+  }
+  return best;
+}
+
+//--------------------------------------------------
+// AFK-MC2 seeding: approximates k-means++ D^2 sampling with Markov
+// chains. A single pass builds the proposal q(x) = d(x, c1)^2 / 2 sum +
+// 1 / 2n, after which every centroid costs chain_length draws from q
+// instead of a pass over all samples.
+// https://papers.nips.cc/paper/6478-fast-and-provably-good-seedings-for-k-means
+//--------------------------------------------------
+void afkmc2_centroids(Centroids *c, Samples *s, int k, int chain_length)
+{
+  int n = s->count;
+  double *cumulative = malloc(n * sizeof(double));
+  if (cumulative == NULL || n == 0)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for cumulative on afkmc2_centroids method\n");
+    free(cumulative);
+    create_centroids(c, k);
+    return;
+  }
+
+  // The first centroid is drawn in proportion to the weights
+  double total_weight = 0.0;
+  for (int i = 0; i < n; i++)
+  {
+    total_weight += s->items[i].weight;
+    cumulative[i] = total_weight;
+  }
+
+  Sample *first = &s->items[upper_bound(cumulative, n, (double)rand() / RAND_MAX * total_weight)];
+  Vector2 position = {first->x, first->y};
+  c->count = 0;
+  da_append(c, position);
+
+  double total_distance = 0.0;
+#pragma omp parallel for reduction(+ : total_distance)
+  for (int i = 0; i < n; i++)
+  {
+    Sample *sample = &s->items[i];
+    total_distance += (double)sample->weight * ((sample->x - first->x) * (sample->x - first->x) + (sample->y - first->y) * (sample->y - first->y));
+  }
+
+  double running = 0.0;
+  for (int i = 0; i < n; i++)
+  {
+    Sample *sample = &s->items[i];
+    double distance = (sample->x - first->x) * (sample->x - first->x) + (sample->y - first->y) * (sample->y - first->y);
+    double q = total_distance > 0.0 ? 0.5 * distance / total_distance : 0.0;
+    running += sample->weight * (q + 0.5 / total_weight);
+    cumulative[i] = running;
+  }
+
+  for (int j = 1; j < k; j++)
+  {
+    // q is taken per unit of weight, so the chain targets weight * d^2
+    int x = upper_bound(cumulative, n, (double)rand() / RAND_MAX * running);
+    float dx = closest_squared_distance(c, j, &s->items[x]);
+    double qx = (cumulative[x] - (x > 0 ? cumulative[x - 1] : 0.0)) / s->items[x].weight;
+    for (int step = 1; step < chain_length; step++)
+    {
+      int y = upper_bound(cumulative, n, (double)rand() / RAND_MAX * running);
+      float dy = closest_squared_distance(c, j, &s->items[y]);
+      double qy = (cumulative[y] - (y > 0 ? cumulative[y - 1] : 0.0)) / s->items[y].weight;
+      // Metropolis-Hastings acceptance of y as the D^2 sample
+      if (dx == 0.0f || dy * qx > dx * qy * ((double)rand() / RAND_MAX))
+      {
+        x = y;
+        dx = dy;
+        qx = qy;
+      }
+    }
+    position = (Vector2){s->items[x].x, s->items[x].y};
+    da_append(c, position);
+  }
+
+  free(cumulative);
+}
+
 //--------------------------------------------------
 // Draw centroids on window
 //--------------------------------------------------
@@ -142,7 +385,8 @@ void draw_centroids(Centroids *c)
 //--------------------------------------------------
 void assign_step(Centroids *c, Samples *s)
 {
-  float curr_distance;
+  int chunk = assign_chunk;
+#pragma omp parallel for schedule(dynamic, chunk) if (s->count > chunk)
   for (int i = 0; i < s->count; i++)
   {
     Sample *sample = &s->items[i];
@@ -151,7 +395,7 @@ void assign_step(Centroids *c, Samples *s)
     {
       Vector2 centroid = c->items[k];
       // Compute distance from point to centroid
-      curr_distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
+      float curr_distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
 
       // Assign the minimun distance to the sample
       if (curr_distance < best_distance)
@@ -160,142 +404,1537 @@ void assign_step(Centroids *c, Samples *s)
         sample->cluster = k;
       }
     }
+    sample->distance = best_distance;
   }
 }
 
 //--------------------------------------------------
-// Updates centroids center based on its samples
+// Same result as assign_step but abandons a centroid as soon as the
+// partial squared distance exceeds the best one. The current centroid
+// of the sample is tried first so the bound is tight from the start, and
+// the axis along which centroids are most spread is summed first
 //--------------------------------------------------
-void update_step(Centroids *c, Samples *s)
+void partial_assign_step(Centroids *c, Samples *s)
 {
-  Mean *mean_array = malloc(c->count * sizeof(Mean));
-  if (mean_array == NULL)
+  float *first = malloc(2 * c->count * sizeof(float));
+  if (first == NULL)
   {
-    fprintf(stderr, "ERORR: Could not allocate memory for mean_array on update_step method\n");
+    fprintf(stderr, "ERROR: Could not allocate memory for first on partial_assign_step method\n");
+    assign_step(c, s);
     return;
   }
+  float *second = first + c->count;
 
+  float mean_x = 0.0f, mean_y = 0.0f;
+  for (int k = 0; k < c->count; k++)
+  {
+    mean_x += c->items[k].x / c->count;
+    mean_y += c->items[k].y / c->count;
+  }
+  float variance_x = 0.0f, variance_y = 0.0f;
+  for (int k = 0; k < c->count; k++)
+  {
+    variance_x += (c->items[k].x - mean_x) * (c->items[k].x - mean_x);
+    variance_y += (c->items[k].y - mean_y) * (c->items[k].y - mean_y);
+  }
+  bool y_first = variance_y > variance_x;
   for (int k = 0; k < c->count; k++)
   {
-    Mean m = {0};
-    mean_array[k] = m;
+    first[k] = y_first ? c->items[k].y : c->items[k].x;
+    second[k] = y_first ? c->items[k].x : c->items[k].y;
   }
 
+  int chunk = assign_chunk;
+#pragma omp parallel for schedule(dynamic, chunk) if (s->count > chunk)
   for (int i = 0; i < s->count; i++)
   {
-    Sample sample = s->items[i];
-    mean_array[sample.cluster].mean_x += sample.x;
-    mean_array[sample.cluster].mean_y += sample.y;
-    mean_array[sample.cluster].total += 1;
+    Sample *sample = &s->items[i];
+    float a = y_first ? sample->y : sample->x;
+    float b = y_first ? sample->x : sample->y;
+    int best = sample->cluster >= 0 && sample->cluster < c->count ? sample->cluster : 0;
+    float best_distance = (a - first[best]) * (a - first[best]) + (b - second[best]) * (b - second[best]);
+    for (int k = 0; k < c->count; k++)
+    {
+      float partial = (a - first[k]) * (a - first[k]);
+      if (partial >= best_distance)
+        continue;
+      partial += (b - second[k]) * (b - second[k]);
+      if (partial < best_distance)
+      {
+        best_distance = partial;
+        best = k;
+      }
+    }
+    sample->cluster = best;
+    sample->distance = sqrtf(best_distance);
   }
 
-  for (int k = 0; k < c->count; k++)
+  free(first);
+}
+
+//--------------------------------------------------
+// Assigns samples with float squared distances, keeping the best and the
+// second best. Float rounding can only swap them when they are within
+// MIXED_TOLERANCE of each other, so only those samples are evaluated
+// again in double precision. Labels match a double precision assignment
+//--------------------------------------------------
+void mixed_assign_step(Centroids *c, Samples *s)
+{
+  int chunk = assign_chunk;
+#pragma omp parallel for schedule(dynamic, chunk) if (s->count > chunk)
+  for (int i = 0; i < s->count; i++)
   {
-    mean_array[k].mean_x /= mean_array[k].total;
-    mean_array[k].mean_y /= mean_array[k].total;
-    c->items[k].x = mean_array[k].mean_x;
-    c->items[k].y = mean_array[k].mean_y;
-  }
+    Sample *sample = &s->items[i];
+    float best_distance = __FLT_MAX__;
+    float second_distance = __FLT_MAX__;
+    int best = 0;
+    for (int k = 0; k < c->count; k++)
+    {
+      float dx = sample->x - c->items[k].x;
+      float dy = sample->y - c->items[k].y;
+      float distance = dx * dx + dy * dy;
+      if (distance < best_distance)
+      {
+        second_distance = best_distance;
+        best_distance = distance;
+        best = k;
+      }
+      else if (distance < second_distance)
+        second_distance = distance;
+    }
 
-  free(mean_array);
+    if (second_distance - best_distance <= MIXED_TOLERANCE * second_distance)
+    {
+      double best_exact = __DBL_MAX__;
+      for (int k = 0; k < c->count; k++)
+      {
+        double dx = (double)sample->x - c->items[k].x;
+        double dy = (double)sample->y - c->items[k].y;
+        double distance = dx * dx + dy * dy;
+        if (distance < best_exact)
+        {
+          best_exact = distance;
+          best = k;
+        }
+      }
+      best_distance = best_exact;
+    }
+
+    sample->cluster = best;
+    sample->distance = sqrtf(best_distance);
+  }
 }
 
 //--------------------------------------------------
-// Kmeans converge when centroids have not change
+// Full assignment that also remembers the nearest centroids of each sample.
+// Before the lists are replaced, the label they would give with the current
+// centroids is compared to the exact one to measure their disagreement
 //--------------------------------------------------
-bool converged(Centroids *previus, Centroids *centroids)
+void candidate_refresh(Centroids *c, Samples *s, Candidates *lists)
 {
-  if (previus->count != centroids->count)
-    return false;
+  int m = c->count < CANDIDATE_COUNT ? c->count : CANDIDATE_COUNT;
+  bool measure = lists->items != NULL && lists->count == s->count && lists->per_sample == m;
+  if (!measure)
+  {
+    free(lists->items);
+    free(lists->anchor);
+    lists->items = malloc((size_t)s->count * m * sizeof(int));
+    lists->anchor = malloc(c->count * sizeof(Vector2));
+    lists->count = s->count;
+    lists->per_sample = m;
+    if (lists->items == NULL || lists->anchor == NULL)
+    {
+      fprintf(stderr, "ERROR: Can't allocate memory for the candidate lists on candidate_refresh method\n");
+      free(lists->items);
+      free(lists->anchor);
+      *lists = (Candidates){0};
+      assign_step(c, s);
+      return;
+    }
+  }
 
-  const float EPSILON = 0.0001f;
-  for (int i = 0; i < centroids->count; i++)
+  long wrong = 0, total = 0;
+  double squares = 0.0;
+  long weights = 0;
+  int chunk = assign_chunk;
+#pragma omp parallel for schedule(dynamic, chunk) if (s->count > chunk) reduction(+ : wrong, total, squares, weights)
+  for (int i = 0; i < s->count; i++)
   {
-    float dx = previus->items[i].x - centroids->items[i].x;
-    float dy = previus->items[i].y - centroids->items[i].y;
-    if (dx * dx + dy * dy > EPSILON)
-      return false;
+    Sample *sample = &s->items[i];
+    int *list = &lists->items[(size_t)i * m];
+
+    int approximate = -1;
+    if (measure)
+    {
+      float best_distance = __FLT_MAX__;
+      for (int j = 0; j < m; j++)
+      {
+        float dx = sample->x - c->items[list[j]].x;
+        float dy = sample->y - c->items[list[j]].y;
+        if (dx * dx + dy * dy < best_distance)
+        {
+          best_distance = dx * dx + dy * dy;
+          approximate = list[j];
+        }
+      }
+    }
+
+    // Insertion into the m nearest so far, closest first
+    float nearest[CANDIDATE_COUNT];
+    int filled = 0;
+    for (int k = 0; k < c->count; k++)
+    {
+      float dx = sample->x - c->items[k].x;
+      float dy = sample->y - c->items[k].y;
+      float distance = dx * dx + dy * dy;
+      if (filled == m && distance >= nearest[m - 1])
+        continue;
+      int j = filled < m ? filled++ : m - 1;
+      for (; j > 0 && nearest[j - 1] > distance; j--)
+      {
+        nearest[j] = nearest[j - 1];
+        list[j] = list[j - 1];
+      }
+      nearest[j] = distance;
+      list[j] = k;
+    }
+
+    sample->cluster = list[0];
+    sample->distance = sqrtf(nearest[0]);
+    squares += (double)sample->weight * nearest[0];
+    weights += sample->weight;
+    if (measure)
+    {
+      wrong += approximate != list[0] ? sample->weight : 0;
+      total += sample->weight;
+    }
   }
-  return true;
+
+  if (measure)
+    lists->disagreement = total > 0 ? (double)wrong / total : 0.0;
+  memcpy(lists->anchor, c->items, c->count * sizeof(Vector2));
+  lists->spread = weights > 0 ? sqrt(squares / weights) : 0.0f;
+  lists->since_refresh = 0;
+  lists->refreshes++;
 }
 
 //--------------------------------------------------
-// Run Kmeans
+// Approximate assignment that only tries the centroids remembered by the
+// last full assignment. A full one runs every CANDIDATE_REFRESH calls, or
+// sooner once a centroid moved more than CANDIDATE_DRIFT times the RMS
+// sample distance since then
 //--------------------------------------------------
-void run_kmeans(Centroids *centroids, Samples *samples, float *time_between_updates)
+void candidate_assign_step(Centroids *c, Samples *s, Candidates *lists)
 {
-  if (*time_between_updates < 1.0f)
+  int m = c->count < CANDIDATE_COUNT ? c->count : CANDIDATE_COUNT;
+  float drift = CANDIDATE_DRIFT * lists->spread;
+  bool stale = lists->items == NULL || lists->count != s->count || lists->per_sample != m ||
+               ++lists->since_refresh >= CANDIDATE_REFRESH;
+  for (int k = 0; !stale && k < c->count; k++)
+  {
+    float dx = c->items[k].x - lists->anchor[k].x;
+    float dy = c->items[k].y - lists->anchor[k].y;
+    stale = dx * dx + dy * dy > drift * drift;
+  }
+  if (stale)
+  {
+    candidate_refresh(c, s, lists);
     return;
+  }
 
-  Centroids previous;
-  previous.items = malloc(sizeof(Vector2) * centroids->capacity);
-  previous.capacity = centroids->capacity;
+  int chunk = assign_chunk;
+#pragma omp parallel for schedule(dynamic, chunk) if (s->count > chunk)
+  for (int i = 0; i < s->count; i++)
+  {
+    Sample *sample = &s->items[i];
+    int *list = &lists->items[(size_t)i * m];
+    float best_distance = __FLT_MAX__;
+    for (int j = 0; j < m; j++)
+    {
+      float dx = sample->x - c->items[list[j]].x;
+      float dy = sample->y - c->items[list[j]].y;
+      float distance = dx * dx + dy * dy;
+      if (distance < best_distance)
+      {
+        best_distance = distance;
+        sample->cluster = list[j];
+      }
+    }
+    sample->distance = sqrtf(best_distance);
+  }
+}
 
-  while (!converged(&previous, centroids))
+//--------------------------------------------------
+// Smallest distance whose cumulative weight reaches rank (1 based).
+// Reorders the array, runs in O(n) on average
+//--------------------------------------------------
+float select_weighted(WeightedDistance *values, int count, long rank)
+{
+  int left = 0;
+  int right = count;
+  while (right - left > 1)
   {
-    previous.count = centroids->count;
-    memcpy(previous.items, centroids->items,
-           sizeof(Vector2) * centroids->count);
+    // Three way partition: [left, lt) < pivot, [lt, gt) == pivot, [gt, right) > pivot
+    float pivot = values[left + (right - left) / 2].distance;
+    int lt = left, i = left, gt = right;
+    long less = 0, equal = 0;
+    while (i < gt)
+    {
+      WeightedDistance value = values[i];
+      if (value.distance < pivot)
+      {
+        less += value.weight;
+        values[i++] = values[lt];
+        values[lt++] = value;
+      }
+      else if (value.distance > pivot)
+      {
+        values[i] = values[--gt];
+        values[gt] = value;
+      }
+      else
+      {
+        equal += value.weight;
+        i++;
+      }
+    }
 
-    assign_step(centroids, samples);
-    update_step(centroids, samples);
+    if (rank <= less)
+      right = lt;
+    else if (rank <= less + equal)
+      return pivot;
+    else
+    {
+      rank -= less + equal;
+      left = gt;
+    }
   }
+  return values[left].distance;
+}
 
-  *time_between_updates = 0.0f;
-  free(previous.items);
+//--------------------------------------------------
+// Histogram bin of a distance for trim_cutoff
+//--------------------------------------------------
+int trim_bin(float distance, float max_distance)
+{
+  int bin = (int)(distance / max_distance * TRIM_BINS);
+  return bin < TRIM_BINS ? bin : TRIM_BINS - 1;
 }
 
 //--------------------------------------------------
-// Kmeans algorithm:
-// 1. Create k initial centroids randomly
-// 2. Create k clusters by associating each point with the nearest mean
-// 3. Update the centroids
-// 4. Repeat steps 2 and 3 until convergence
+// Distance under which samples are kept when the alpha fraction
+// farthest from their centroid is trimmed. Uses a histogram over the
+// distances computed by assign_step and only selects inside the bin
+// holding the cutoff, so the cost stays linear
 //--------------------------------------------------
-int main()
+float trim_cutoff(Samples *s, float alpha)
 {
-  InitWindow(800, 600, "Kmeans");
-  SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+  long total = 0;
+  float max_distance = 0.0f;
+#pragma omp parallel for reduction(+ : total) reduction(max : max_distance)
+  for (int i = 0; i < s->count; i++)
+  {
+    total += s->items[i].weight;
+    if (s->items[i].distance > max_distance)
+      max_distance = s->items[i].distance;
+  }
 
-  size_t num_samples = 25;
-  Vector2 center = (Vector2){
-      .x = WINDOW_WIDTH / 2,
-      .y = WINDOW_HEIGHT / 2};
-  double radius = 50.0;
-  Samples samples = {0};
+  long keep = total - (long)(alpha * total);
+  if (keep >= total)
+    return __FLT_MAX__;
+  if (keep <= 0)
+    return -1.0f;
+  if (max_distance == 0.0f)
+    return 0.0f;
 
-  generate_samples(&samples, center, num_samples, radius);
+  long histogram[TRIM_BINS] = {0};
+#pragma omp parallel
+  {
+    long local[TRIM_BINS] = {0};
+#pragma omp for nowait
+    for (int i = 0; i < s->count; i++)
+      local[trim_bin(s->items[i].distance, max_distance)] += s->items[i].weight;
+#pragma omp critical
+    for (int b = 0; b < TRIM_BINS; b++)
+      histogram[b] += local[b];
+  }
 
-  center.y += center.y / 2;
-  generate_samples(&samples, center, num_samples, radius);
+  // Find the bin holding the keep-th smallest distance
+  int bin = 0;
+  long below = 0;
+  while (below + histogram[bin] < keep)
+    below += histogram[bin++];
 
-  center.x += center.x / 2;
-  generate_samples(&samples, center, num_samples, radius);
+  int count = 0;
+  for (int i = 0; i < s->count; i++)
+    if (trim_bin(s->items[i].distance, max_distance) == bin)
+      count++;
 
-  center.x -= center.x * 0.7;
-  generate_samples(&samples, center, num_samples, radius);
+  WeightedDistance *candidates = malloc(count * sizeof(WeightedDistance));
+  if (candidates == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for candidates on trim_cutoff method\n");
+    return __FLT_MAX__;
+  }
 
-  Centroids centroids = {0};
-  create_centroids(&centroids, 3);
+  count = 0;
+  for (int i = 0; i < s->count; i++)
+    if (trim_bin(s->items[i].distance, max_distance) == bin)
+      candidates[count++] = (WeightedDistance){s->items[i].distance, s->items[i].weight};
 
-  float dt;
-  float time_between_updates = 0.0f;
+  float cutoff = select_weighted(candidates, count, keep - below);
+  free(candidates);
+  return cutoff;
+}
 
-  Centroids previus;
-  while (!WindowShouldClose())
+//--------------------------------------------------
+// Pushes a bid on a min heap ordered by value
+//--------------------------------------------------
+void bid_heap_push(Bids *heap, Bid bid)
+{
+  da_append(heap, bid);
+  int i = heap->count - 1;
+  while (i > 0 && heap->items[(i - 1) / 2].value > bid.value)
   {
-    dt = GetFrameTime();
-    time_between_updates += dt;
+    heap->items[i] = heap->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap->items[i] = bid;
+}
 
-    BeginDrawing();
-    ClearBackground(RAYWHITE);
-    draw_centroids(&centroids);
-    draw_samples(&samples);
-    run_kmeans(&centroids, &samples, &time_between_updates);
-    EndDrawing();
+//--------------------------------------------------
+// Removes and returns the lowest bid of a min heap
+//--------------------------------------------------
+Bid bid_heap_pop(Bids *heap)
+{
+  Bid top = heap->items[0];
+  Bid last = heap->items[--heap->count];
+  int i = 0;
+  while (2 * i + 1 < heap->count)
+  {
+    int child = 2 * i + 1;
+    if (child + 1 < heap->count && heap->items[child + 1].value < heap->items[child].value)
+      child++;
+    if (heap->items[child].value >= last.value)
+      break;
+    heap->items[i] = heap->items[child];
+    i = child;
   }
+  if (heap->count > 0)
+    heap->items[i] = last;
+  return top;
+}
 
-  CloseWindow();
+//--------------------------------------------------
+// Returns the distance from a sample to the nearest centroid outside its
+// m candidates that still has room for its weight
+//--------------------------------------------------
+float balanced_escape(Centroids *c, Sample *sample, int *cand, int m, long *loads, long capacity)
+{
+  float best_distance = __FLT_MAX__;
+  for (int j = 0; j < c->count; j++)
+  {
+    if (loads[j] + sample->weight > capacity)
+      continue;
+    bool candidate = false;
+    for (int l = 0; l < m; l++)
+      candidate = candidate || cand[l] == j;
+    if (candidate)
+      continue;
+    Vector2 centroid = c->items[j];
+    float distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
+    if (distance < best_distance)
+      best_distance = distance;
+  }
+  return best_distance;
+}
 
-  return 0;
-}
\ No newline at end of file
+//--------------------------------------------------
+// Assigns each sample to a centroid so no cluster holds more than
+// ceil(w / k * (1 + BALANCE_SLACK)) of the total sample weight w.
+// Runs an auction where samples bid for their BALANCE_CANDIDATES nearest
+// centroids. A full centroid keeps its highest bids and its price is the
+// lowest bid it holds, so outbid samples move to their next best choice.
+// A sample leaves the auction after BALANCE_MAX_BIDS bids, or once its
+// candidates cost more than the nearest centroid outside them that still
+// has room, so a dense blob cannot keep the whole auction busy
+//--------------------------------------------------
+void balanced_assign_step(Centroids *c, Samples *s)
+{
+  int n = s->count;
+  int k = c->count;
+  int m = BALANCE_CANDIDATES < k ? BALANCE_CANDIDATES : k;
+
+  int *candidates = malloc((size_t)n * m * sizeof(int));
+  float *costs = malloc((size_t)n * m * sizeof(float));
+  float *prices = calloc(k, sizeof(float));
+  Bids *heaps = calloc(k, sizeof(Bids));
+  long *loads = calloc(k, sizeof(long));
+  int *pending = malloc(n * sizeof(int));
+  int *bids = calloc(n, sizeof(int));
+  float *escapes = malloc(n * sizeof(float));
+  if (candidates == NULL || costs == NULL || prices == NULL ||
+      heaps == NULL || loads == NULL || pending == NULL ||
+      bids == NULL || escapes == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory on balanced_assign_step method\n");
+    free(candidates);
+    free(costs);
+    free(prices);
+    free(heaps);
+    free(loads);
+    free(pending);
+    free(bids);
+    free(escapes);
+    assign_step(c, s);
+    return;
+  }
+
+  // Keep the m nearest centroids of every sample, sorted by distance
+  double total_distance = 0.0;
+  long total_weight = 0;
+#pragma omp parallel for reduction(+ : total_distance, total_weight)
+  for (int i = 0; i < n; i++)
+  {
+    Sample *sample = &s->items[i];
+    int *cand = &candidates[(size_t)i * m];
+    float *cost = &costs[(size_t)i * m];
+    int found = 0;
+    for (int j = 0; j < k; j++)
+    {
+      Vector2 centroid = c->items[j];
+      float distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
+      if (found == m && distance >= cost[m - 1])
+        continue;
+      int pos = found < m ? found++ : m - 1;
+      while (pos > 0 && cost[pos - 1] > distance)
+      {
+        cost[pos] = cost[pos - 1];
+        cand[pos] = cand[pos - 1];
+        pos--;
+      }
+      cost[pos] = distance;
+      cand[pos] = j;
+    }
+    sample->cluster = -1;
+    total_distance += cost[0];
+    total_weight += sample->weight;
+  }
+
+  long capacity = (long)ceil((double)total_weight / k * (1.0 + BALANCE_SLACK));
+
+  // Bid increments smaller than epsilon cannot change the outcome much
+  float epsilon = 1e-3f * (float)(total_distance / (n > 0 ? n : 1)) + 1e-6f;
+  int pending_count = 0;
+  for (int i = n - 1; i >= 0; i--)
+    pending[pending_count++] = i;
+
+  while (pending_count > 0)
+  {
+    int i = pending[--pending_count];
+    int *cand = &candidates[(size_t)i * m];
+    float *cost = &costs[(size_t)i * m];
+    int weight = s->items[i].weight;
+    // A sample heavier than a whole cluster can never win, leave it to the fallback
+    if (weight > capacity || bids[i]++ == BALANCE_MAX_BIDS)
+      continue;
+
+    int best = 0;
+    float best_net = __FLT_MAX__;
+    float second_net = __FLT_MAX__;
+    for (int j = 0; j < m; j++)
+    {
+      float net = cost[j] + prices[cand[j]];
+      if (net < best_net)
+      {
+        second_net = best_net;
+        best_net = net;
+        best = j;
+      }
+      else if (net < second_net)
+        second_net = net;
+    }
+    // Once outbid, the sample is only worth another bid while its candidates
+    // beat the nearest centroid it could fall back to for free
+    if (bids[i] == 2)
+      escapes[i] = balanced_escape(c, &s->items[i], cand, m, loads, capacity);
+    if (bids[i] > 1 && best_net > escapes[i])
+      continue;
+
+    // With a single candidate any bid wins, the margin only has to be finite
+    if (second_net == __FLT_MAX__)
+      second_net = best_net + cost[m - 1] + epsilon;
+
+    // Bids are per unit of weight, a heavy sample pushes out as many
+    // of the lowest bids as it needs to fit
+    int cluster = cand[best];
+    // The increment doubles with every bid the sample makes, so a contested
+    // centroid reaches its final price in a few rounds instead of creeping up
+    Bid bid = {prices[cluster] + (second_net - best_net) + ldexpf(epsilon, bids[i] - 1), i};
+    Bids *heap = &heaps[cluster];
+    bool evicted = false;
+    while (loads[cluster] + weight > capacity)
+    {
+      Bid outbid = bid_heap_pop(heap);
+      loads[cluster] -= s->items[outbid.sample].weight;
+      s->items[outbid.sample].cluster = -1;
+      pending[pending_count++] = outbid.sample;
+      evicted = true;
+    }
+    bid_heap_push(heap, bid);
+    loads[cluster] += weight;
+    s->items[i].cluster = cluster;
+    s->items[i].distance = cost[best];
+    if (evicted || loads[cluster] == capacity)
+      prices[cluster] = heap->items[0].value;
+  }
+
+  // Samples whose candidates stayed full go to the nearest centroid with
+  // room for their weight, or to the emptiest one when none has
+  for (int i = 0; i < n; i++)
+  {
+    Sample *sample = &s->items[i];
+    if (sample->cluster != -1)
+      continue;
+    float best_distance = __FLT_MAX__;
+    int emptiest = 0;
+    for (int j = 0; j < k; j++)
+    {
+      if (loads[j] < loads[emptiest])
+        emptiest = j;
+      if (loads[j] + sample->weight > capacity)
+        continue;
+      Vector2 centroid = c->items[j];
+      float distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
+      if (distance < best_distance)
+      {
+        best_distance = distance;
+        sample->cluster = j;
+      }
+    }
+    if (sample->cluster == -1)
+    {
+      Vector2 centroid = c->items[emptiest];
+      sample->cluster = emptiest;
+      best_distance = sqrtf((sample->x - centroid.x) * (sample->x - centroid.x) + (sample->y - centroid.y) * (sample->y - centroid.y));
+    }
+    sample->distance = best_distance;
+    loads[sample->cluster] += sample->weight;
+  }
+
+  for (int j = 0; j < k; j++)
+    free(heaps[j].items);
+  free(candidates);
+  free(costs);
+  free(prices);
+  free(heaps);
+  free(loads);
+  free(pending);
+  free(bids);
+  free(escapes);
+}
+
+//--------------------------------------------------
+// Updates centroids center based on its samples.
+// Samples farther than cutoff from their centroid are ignored.
+// Every thread sums into its own copy of the clusters, so the scatter
+// never conflicts, and the copies are added together in thread order at
+// the end, so a given thread count always gives the same centroids
+//--------------------------------------------------
+void update_step(Centroids *c, Samples *s, float cutoff)
+{
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  Mean *mean_array = calloc(c->count, sizeof(Mean));
+  Mean **partials = calloc(threads, sizeof(Mean *));
+  if (mean_array == NULL || partials == NULL)
+  {
+    fprintf(stderr, "ERORR: Could not allocate memory for mean_array on update_step method\n");
+    free(mean_array);
+    free(partials);
+    return;
+  }
+
+  int chunk = assign_chunk;
+#pragma omp parallel if (s->count > chunk)
+  {
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    Mean *local = calloc(c->count, sizeof(Mean));
+    assert(local != NULL && "Buy more RAM lol");
+    partials[thread] = local;
+
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < s->count; i++)
+    {
+      Sample sample = s->items[i];
+      if (sample.distance > cutoff)
+        continue;
+      local[sample.cluster].mean_x += sample.weight * sample.x;
+      local[sample.cluster].mean_y += sample.weight * sample.y;
+      local[sample.cluster].total += sample.weight;
+    }
+  }
+
+  for (int t = 0; t < threads; t++)
+  {
+    if (partials[t] == NULL)
+      continue;
+    for (int k = 0; k < c->count; k++)
+    {
+      mean_array[k].mean_x += partials[t][k].mean_x;
+      mean_array[k].mean_y += partials[t][k].mean_y;
+      mean_array[k].total += partials[t][k].total;
+    }
+    free(partials[t]);
+  }
+  free(partials);
+
+  for (int k = 0; k < c->count; k++)
+  {
+    // A centroid left without samples keeps its position
+    if (mean_array[k].total == 0)
+      continue;
+    mean_array[k].mean_x /= mean_array[k].total;
+    mean_array[k].mean_y /= mean_array[k].total;
+    c->items[k].x = mean_array[k].mean_x;
+    c->items[k].y = mean_array[k].mean_y;
+  }
+
+  free(mean_array);
+}
+
+//--------------------------------------------------
+// Kmeans converge when centroids have not change
+//--------------------------------------------------
+bool converged(Centroids *previus, Centroids *centroids)
+{
+  if (previus->count != centroids->count)
+    return false;
+
+  const float EPSILON = 0.0001f;
+  for (int i = 0; i < centroids->count; i++)
+  {
+    float dx = previus->items[i].x - centroids->items[i].x;
+    float dy = previus->items[i].y - centroids->items[i].y;
+    if (dx * dx + dy * dy > EPSILON)
+      return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------
+// Assigns samples with the given engine. ENGINE_CANDIDATES keeps its
+// lists in candidates and falls back to assign_step without them
+//--------------------------------------------------
+void assign_with(Engine engine, Centroids *centroids, Samples *samples, Candidates *candidates)
+{
+  switch (engine)
+  {
+  case ENGINE_LLOYD:
+  case ENGINE_AUTO:
+    assign_step(centroids, samples);
+    break;
+  case ENGINE_PARTIAL:
+    partial_assign_step(centroids, samples);
+    break;
+  case ENGINE_BALANCED:
+    balanced_assign_step(centroids, samples);
+    break;
+  case ENGINE_MIXED:
+    mixed_assign_step(centroids, samples);
+    break;
+  case ENGINE_CANDIDATES:
+    if (candidates != NULL)
+      candidate_assign_step(centroids, samples, candidates);
+    else
+      assign_step(centroids, samples);
+    break;
+  }
+}
+
+//--------------------------------------------------
+// Sum of squared distances from samples to their centroid
+//--------------------------------------------------
+double inertia(Samples *s)
+{
+  double total = 0.0;
+  for (int i = 0; i < s->count; i++)
+    total += (double)s->items[i].weight * s->items[i].distance * s->items[i].distance;
+  return total;
+}
+
+double now_seconds(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//--------------------------------------------------
+// Picks the engine, thread count and chunk size for an assignment.
+// A cost model calibrated with ./bench predicts n * k * cost / threads +
+// threads * COST_THREAD_NS per engine. When the work is large enough to
+// matter, every engine is also timed on a subsample and the measurement
+// replaces the prediction
+//--------------------------------------------------
+EnginePlan choose_plan(Centroids *c, Samples *s)
+{
+  Engine engines[] = {ENGINE_LLOYD, ENGINE_PARTIAL, ENGINE_MIXED};
+  double costs[] = {COST_LLOYD_NS, COST_PARTIAL_NS, COST_MIXED_NS};
+  int count = sizeof(engines) / sizeof(engines[0]);
+  double work = (double)s->count * c->count;
+  int max_threads = 1;
+#ifdef _OPENMP
+  max_threads = omp_get_max_threads();
+#endif
+
+  EnginePlan best = {ENGINE_LLOYD, 1, ASSIGN_CHUNK, __DBL_MAX__, false};
+  for (int e = 0; e < count; e++)
+  {
+    // Threads minimising work / t + t * COST_THREAD_NS
+    int threads = (int)sqrt(work * costs[e] / COST_THREAD_NS);
+    threads = threads < 1 ? 1 : threads > max_threads ? max_threads : threads;
+    double predicted = (work * costs[e] / threads + threads * COST_THREAD_NS) * 1e-9;
+    if (predicted < best.predicted)
+      best = (EnginePlan){engines[e], threads, 0, predicted, false};
+  }
+
+  if (work >= AUTO_TRIAL_MIN_WORK && s->count > AUTO_TRIAL_SAMPLES)
+  {
+    Samples trial = {0};
+    int stride = s->count / AUTO_TRIAL_SAMPLES;
+    for (int i = 0; i < s->count; i += stride)
+      da_append(&trial, s->items[i]);
+
+#ifdef _OPENMP
+    int previous_threads = omp_get_max_threads();
+    omp_set_num_threads(best.threads);
+#endif
+    best.predicted = __DBL_MAX__;
+    for (int e = 0; e < count; e++)
+    {
+      // The second run is timed, partial_assign_step gains from known labels
+      assign_with(engines[e], c, &trial, NULL);
+      double start = now_seconds();
+      assign_with(engines[e], c, &trial, NULL);
+      double predicted = (now_seconds() - start) * s->count / trial.count;
+      if (predicted < best.predicted)
+      {
+        best.engine = engines[e];
+        best.predicted = predicted;
+      }
+    }
+    best.trial = true;
+#ifdef _OPENMP
+    omp_set_num_threads(previous_threads);
+#endif
+    free(trial.items);
+  }
+
+  best.chunk = s->count / (best.threads * 8);
+  if (best.chunk < 256)
+    best.chunk = 256;
+  return best;
+}
+
+//--------------------------------------------------
+// Prints the plan chosen by ENGINE_AUTO when it differs from the last one
+//--------------------------------------------------
+void report_plan(EnginePlan plan)
+{
+  if (plan.engine == last_plan.engine && plan.threads == last_plan.threads && plan.chunk == last_plan.chunk)
+    return;
+  printf("auto engine: %s, %d threads, chunk %d, %.3f ms per assignment (%s)\n",
+         engine_names[plan.engine], plan.threads, plan.chunk, plan.predicted * 1e3,
+         plan.trial ? "timed trial" : "cost model");
+  last_plan = plan;
+}
+
+//--------------------------------------------------
+// Publishes a metrics snapshot without locks or syscalls. The sequence is
+// odd while the snapshot is written, and when another job is publishing
+// at the same time this snapshot is dropped rather than waited for
+//--------------------------------------------------
+void metrics_publish(const Metrics *m)
+{
+  if (atomic_flag_test_and_set_explicit(&metrics_writer, memory_order_acquire))
+    return;
+  unsigned int sequence = atomic_load_explicit(&metrics_sequence, memory_order_relaxed);
+  atomic_store_explicit(&metrics_sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  metrics = *m;
+  atomic_store_explicit(&metrics_sequence, sequence + 2, memory_order_release);
+  atomic_flag_clear_explicit(&metrics_writer, memory_order_release);
+}
+
+//--------------------------------------------------
+// Consistent copy of the last published snapshot, with the counters
+// read at the time of the call
+//--------------------------------------------------
+Metrics metrics_read(void)
+{
+  Metrics copy;
+  unsigned int before, after;
+  do
+  {
+    before = atomic_load_explicit(&metrics_sequence, memory_order_acquire);
+    copy = metrics;
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&metrics_sequence, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  copy.runs = atomic_load(&metrics_runs);
+  copy.assign_total = atomic_load(&metrics_assign_nanoseconds) / 1e9;
+  copy.trim_total = atomic_load(&metrics_trim_nanoseconds) / 1e9;
+  copy.update_total = atomic_load(&metrics_update_nanoseconds) / 1e9;
+  return copy;
+}
+
+long resident_bytes(void)
+{
+  long pages = 0, resident = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return 0;
+  if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(file);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+//--------------------------------------------------
+// Writes the snapshot in the Prometheus text format to a temporary file
+// renamed over path, so scrapers never see a partial file
+//--------------------------------------------------
+bool metrics_write(const char *path, const Metrics *m)
+{
+  char temporary[4096];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE *file = fopen(temporary, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't open %s on metrics_write method\n", temporary);
+    return false;
+  }
+
+  fprintf(file, "# HELP kmeans_runs_total Calls of run_kmeans\n# TYPE kmeans_runs_total counter\n");
+  fprintf(file, "kmeans_runs_total %ld\n", m->runs);
+  fprintf(file, "# HELP kmeans_iteration Iteration of the current run\n# TYPE kmeans_iteration gauge\n");
+  fprintf(file, "kmeans_iteration %ld\n", m->iteration);
+  fprintf(file, "# HELP kmeans_inertia Sum of squared distances to the centroids\n# TYPE kmeans_inertia gauge\n");
+  fprintf(file, "kmeans_inertia %.17g\n", m->inertia);
+  fprintf(file, "# HELP kmeans_points_per_second Samples clustered per second in the last iteration\n");
+  fprintf(file, "# TYPE kmeans_points_per_second gauge\nkmeans_points_per_second %.6g\n", m->points_per_second);
+  fprintf(file, "# HELP kmeans_phase_seconds Duration of each phase in the last iteration\n# TYPE kmeans_phase_seconds gauge\n");
+  fprintf(file, "kmeans_phase_seconds{phase=\"assign\"} %.9f\n", m->assign_seconds);
+  fprintf(file, "kmeans_phase_seconds{phase=\"trim\"} %.9f\n", m->trim_seconds);
+  fprintf(file, "kmeans_phase_seconds{phase=\"update\"} %.9f\n", m->update_seconds);
+  fprintf(file, "# HELP kmeans_phase_seconds_total Time spent in each phase\n# TYPE kmeans_phase_seconds_total counter\n");
+  fprintf(file, "kmeans_phase_seconds_total{phase=\"assign\"} %.9f\n", m->assign_total);
+  fprintf(file, "kmeans_phase_seconds_total{phase=\"trim\"} %.9f\n", m->trim_total);
+  fprintf(file, "kmeans_phase_seconds_total{phase=\"update\"} %.9f\n", m->update_total);
+  fprintf(file, "# HELP kmeans_resident_bytes Resident set size of the process\n# TYPE kmeans_resident_bytes gauge\n");
+  fprintf(file, "kmeans_resident_bytes %ld\n", resident_bytes());
+
+  if (fclose(file) != 0 || rename(temporary, path) != 0)
+  {
+    fprintf(stderr, "ERROR: Can't write %s on metrics_write method\n", path);
+    remove(temporary);
+    return false;
+  }
+  return true;
+}
+
+void metrics_dump(FILE *file, const Metrics *m)
+{
+  fprintf(file, "kmeans stats: run %ld, iteration %ld, %d samples, %d clusters, engine %s\n",
+          m->runs, m->iteration, m->samples, m->clusters, engine_names[m->engine]);
+  fprintf(file, "  inertia %.6g, %.6g points/s, resident %ld bytes\n",
+          m->inertia, m->points_per_second, resident_bytes());
+  fprintf(file, "  last iteration: assign %.6f s, trim %.6f s, update %.6f s\n",
+          m->assign_seconds, m->trim_seconds, m->update_seconds);
+  fprintf(file, "  total: assign %.6f s, trim %.6f s, update %.6f s\n",
+          m->assign_total, m->trim_total, m->update_total);
+}
+
+void metrics_signal(int signal)
+{
+  (void)signal;
+  metrics_dump_requested = 1;
+}
+
+//--------------------------------------------------
+// Background thread writing METRICS_FILE every METRICS_INTERVAL seconds
+// and dumping the stats to stderr after a SIGUSR1
+//--------------------------------------------------
+void *metrics_worker(void *arg)
+{
+  (void)arg;
+  struct timespec tick = {0, 100000000};
+  for (long ticks = 0;; ticks++)
+  {
+    nanosleep(&tick, NULL);
+    if (metrics_dump_requested)
+    {
+      metrics_dump_requested = 0;
+      Metrics m = metrics_read();
+      metrics_dump(stderr, &m);
+    }
+    if (ticks % (METRICS_INTERVAL * 10) == 0)
+    {
+      Metrics m = metrics_read();
+      metrics_write(METRICS_FILE, &m);
+    }
+  }
+  return NULL;
+}
+
+void metrics_start(void)
+{
+  struct sigaction action = {0};
+  action.sa_handler = metrics_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, metrics_worker, NULL) != 0)
+  {
+    fprintf(stderr, "ERROR: Can't start the metrics thread on metrics_start method\n");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+//--------------------------------------------------
+// Run Kmeans.
+// With OVER_RELAXATION every update is stretched by a factor that grows
+// while the inertia keeps dropping. Plain Lloyd steps never increase the
+// inertia, so when it goes up the stretched step is thrown away in
+// favour of the plain one and the factor starts again from 1.
+// With a METRICS_FILE every iteration publishes its timings and inertia
+//--------------------------------------------------
+void run_kmeans(Centroids *centroids, Samples *samples, float *time_between_updates)
+{
+  if (*time_between_updates < 1.0f)
+    return;
+
+  Centroids previous;
+  previous.items = malloc(sizeof(Vector2) * centroids->capacity);
+  previous.capacity = centroids->capacity;
+  previous.count = 0;
+  Vector2 *plain = malloc(sizeof(Vector2) * centroids->capacity);
+  float relaxation = 1.0f;
+  double last_inertia = __DBL_MAX__;
+  Candidates candidates = {0};
+  bool monitored = METRICS_FILE[0] != '\0';
+  static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+  if (monitored)
+    pthread_once(&metrics_once, metrics_start);
+  Metrics m = {.runs = atomic_fetch_add(&metrics_runs, 1) + 1, .samples = samples->count, .clusters = centroids->count};
+
+  Engine engine = KMEANS_ENGINE;
+#ifdef _OPENMP
+  int previous_threads = omp_get_max_threads();
+#endif
+  if (engine == ENGINE_AUTO)
+  {
+    EnginePlan plan = choose_plan(centroids, samples);
+    report_plan(plan);
+    engine = plan.engine;
+    assign_chunk = plan.chunk;
+#ifdef _OPENMP
+    omp_set_num_threads(plan.threads);
+#endif
+  }
+
+  // Balanced assignments may flip between equally good solutions,
+  // so the loop is also bounded by MAX_ITERATIONS
+  for (int iteration = 0; iteration < MAX_ITERATIONS && !converged(&previous, centroids); iteration++)
+  {
+    previous.count = centroids->count;
+    memcpy(previous.items, centroids->items,
+           sizeof(Vector2) * centroids->count);
+
+    double started = monitored ? now_seconds() : 0.0;
+    assign_with(engine, centroids, samples, &candidates);
+    if (OVER_RELAXATION)
+    {
+      double current = inertia(samples);
+      if (relaxation > 1.0f && current > last_inertia)
+      {
+        memcpy(centroids->items, plain, sizeof(Vector2) * centroids->count);
+        memcpy(previous.items, plain, sizeof(Vector2) * centroids->count);
+        assign_with(engine, centroids, samples, &candidates);
+        current = inertia(samples);
+        relaxation = 1.0f;
+      }
+      else if (relaxation * RELAXATION_GROWTH <= RELAXATION_MAX)
+        relaxation *= RELAXATION_GROWTH;
+      last_inertia = current;
+    }
+
+    double assigned = monitored ? now_seconds() : 0.0;
+    float cutoff = TRIM_ALPHA > 0.0f ? trim_cutoff(samples, TRIM_ALPHA) : __FLT_MAX__;
+    double trimmed = monitored ? now_seconds() : 0.0;
+    update_step(centroids, samples, cutoff);
+
+    if (monitored)
+    {
+      double updated = now_seconds();
+      m.iteration = iteration + 1;
+      m.engine = engine;
+      m.inertia = inertia(samples);
+      m.assign_seconds = assigned - started;
+      m.trim_seconds = trimmed - assigned;
+      m.update_seconds = updated - trimmed;
+      atomic_fetch_add(&metrics_assign_nanoseconds, (long long)(m.assign_seconds * 1e9));
+      atomic_fetch_add(&metrics_trim_nanoseconds, (long long)(m.trim_seconds * 1e9));
+      atomic_fetch_add(&metrics_update_nanoseconds, (long long)(m.update_seconds * 1e9));
+      m.points_per_second = updated > started ? samples->count / (updated - started) : 0.0;
+      metrics_publish(&m);
+    }
+
+    if (OVER_RELAXATION)
+    {
+      memcpy(plain, centroids->items, sizeof(Vector2) * centroids->count);
+      for (int k = 0; k < centroids->count; k++)
+      {
+        centroids->items[k].x = previous.items[k].x + relaxation * (plain[k].x - previous.items[k].x);
+        centroids->items[k].y = previous.items[k].y + relaxation * (plain[k].y - previous.items[k].y);
+      }
+    }
+  }
+
+  if (candidates.refreshes > 1)
+    printf("candidates: %d full assignments, %.2f%% of labels differed at the last one\n",
+           candidates.refreshes, candidates.disagreement * 100.0);
+  free(candidates.items);
+  free(candidates.anchor);
+
+  assign_chunk = ASSIGN_CHUNK;
+#ifdef _OPENMP
+  omp_set_num_threads(previous_threads);
+#endif
+  *time_between_updates = 0.0f;
+  free(previous.items);
+  free(plain);
+}
+
+//--------------------------------------------------
+// Runs run_kmeans for kmeans_submit on a worker thread
+//--------------------------------------------------
+void kmeans_job_run(void *arg)
+{
+  KmeansArgs *args = arg;
+  float time_between_updates = 1.0f;
+  run_kmeans(args->centroids, args->samples, &time_between_updates);
+  free(args);
+}
+
+//--------------------------------------------------
+// Queues run_kmeans on the given centroids and samples and returns at once.
+// Both must stay untouched until the job is done, see job_submit.
+// Samples and Centroids only exist in this file, so programs reach it by
+// defining KMEANS_BENCH, which drops main, and including main.c like bench.c
+//--------------------------------------------------
+Job *kmeans_submit(JobPool *pool, Centroids *c, Samples *s, JobCallback callback, void *user_data)
+{
+  KmeansArgs *args = malloc(sizeof(KmeansArgs));
+  if (args == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't allocate memory for the arguments on kmeans_submit method\n");
+    return NULL;
+  }
+  args->centroids = c;
+  args->samples = s;
+  Job *job = job_submit(pool, kmeans_job_run, args, callback, user_data);
+  if (job == NULL)
+    free(args);
+  return job;
+}
+
+//--------------------------------------------------
+// Hash key of a sample position. -0 and 0 share a key and every NaN maps
+// to the same one, so DEDUP_EMPTY is never a valid key
+//--------------------------------------------------
+uint64_t position_key(float x, float y)
+{
+  uint32_t bits[2];
+  float coords[2] = {x == 0.0f ? 0.0f : x, y == 0.0f ? 0.0f : y};
+  for (int i = 0; i < 2; i++)
+  {
+    if (isnan(coords[i]))
+      coords[i] = NAN;
+    memcpy(&bits[i], &coords[i], sizeof(float));
+  }
+  return (uint64_t)bits[0] << 32 | bits[1];
+}
+
+uint64_t mix_key(uint64_t key)
+{
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+//--------------------------------------------------
+// Collapses identical samples into weighted unique ones.
+// Threads insert positions into a shared open addressing table, claiming
+// empty slots with compare-and-swap and counting duplicates atomically.
+// mapping[i] receives the index in unique of sample i, so labels can be
+// copied back with expand_labels. Returns false if memory ran out
+//--------------------------------------------------
+bool dedup_samples(Samples *s, Samples *unique, int *mapping)
+{
+  size_t size = 16;
+  while (size < 2 * (size_t)s->count)
+    size *= 2;
+  uint64_t *keys = malloc(size * sizeof(uint64_t));
+  int *weights = calloc(size, sizeof(int));
+  int *ids = malloc(size * sizeof(int));
+  if (keys == NULL || weights == NULL || ids == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory for the table on dedup_samples method\n");
+    free(keys);
+    free(weights);
+    free(ids);
+    return false;
+  }
+  memset(keys, 0xff, size * sizeof(uint64_t));
+
+  // mapping holds the slot of every sample until ids are known
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < s->count; i++)
+  {
+    uint64_t key = position_key(s->items[i].x, s->items[i].y);
+    size_t slot = mix_key(key) & (size - 1);
+    while (true)
+    {
+      uint64_t current = __atomic_load_n(&keys[slot], __ATOMIC_ACQUIRE);
+      if (current == DEDUP_EMPTY)
+      {
+        uint64_t expected = DEDUP_EMPTY;
+        if (__atomic_compare_exchange_n(&keys[slot], &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+          break;
+        current = expected;
+      }
+      if (current == key)
+        break;
+      slot = (slot + 1) & (size - 1);
+    }
+    __atomic_fetch_add(&weights[slot], s->items[i].weight, __ATOMIC_RELAXED);
+    mapping[i] = (int)slot;
+  }
+
+  unique->count = 0;
+  for (size_t slot = 0; slot < size; slot++)
+  {
+    if (keys[slot] == DEDUP_EMPTY)
+      continue;
+    ids[slot] = unique->count;
+    Sample sample = {0};
+    uint32_t bits[2] = {keys[slot] >> 32, keys[slot] & 0xffffffff};
+    memcpy(&sample.x, &bits[0], sizeof(float));
+    memcpy(&sample.y, &bits[1], sizeof(float));
+    sample.cluster = -1;
+    sample.weight = weights[slot];
+    da_append(unique, sample);
+  }
+
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < s->count; i++)
+    mapping[i] = ids[mapping[i]];
+
+  free(keys);
+  free(weights);
+  free(ids);
+  return true;
+}
+
+//--------------------------------------------------
+// Copies the labels of unique samples back to the original ones
+//--------------------------------------------------
+void expand_labels(Samples *unique, const int *mapping, Samples *s)
+{
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < s->count; i++)
+  {
+    s->items[i].cluster = unique->items[mapping[i]].cluster;
+    s->items[i].distance = unique->items[mapping[i]].distance;
+  }
+}
+
+//--------------------------------------------------
+// Index of the centroid closest to a point
+//--------------------------------------------------
+int nearest_centroid(Centroids *c, float x, float y)
+{
+  int best = 0;
+  float best_distance = __FLT_MAX__;
+  for (int k = 0; k < c->count; k++)
+  {
+    float distance = (x - c->items[k].x) * (x - c->items[k].x) + (y - c->items[k].y) * (y - c->items[k].y);
+    if (distance < best_distance)
+    {
+      best_distance = distance;
+      best = k;
+    }
+  }
+  return best;
+}
+
+//--------------------------------------------------
+// Lloyd iterations over the samples picked by index, which may repeat.
+// Every pick counts once, the resampling already accounts for weights.
+// Labels are written to labels[0..count) so several views of the same
+// samples can be clustered at once
+//--------------------------------------------------
+void run_kmeans_view(Centroids *c, Samples *s, const int *index, int count, int *labels)
+{
+  Mean *mean_array = malloc(c->count * sizeof(Mean));
+  Centroids previous = {malloc(c->count * sizeof(Vector2)), 0, c->count};
+  if (mean_array == NULL || previous.items == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not allocate memory on run_kmeans_view method\n");
+    free(mean_array);
+    free(previous.items);
+    return;
+  }
+
+  for (int iteration = 0; iteration < MAX_ITERATIONS && !converged(&previous, c); iteration++)
+  {
+    previous.count = c->count;
+    memcpy(previous.items, c->items, c->count * sizeof(Vector2));
+    memset(mean_array, 0, c->count * sizeof(Mean));
+
+    for (int i = 0; i < count; i++)
+    {
+      Sample sample = s->items[index[i]];
+      labels[i] = nearest_centroid(c, sample.x, sample.y);
+      mean_array[labels[i]].mean_x += sample.x;
+      mean_array[labels[i]].mean_y += sample.y;
+      mean_array[labels[i]].total++;
+    }
+    for (int k = 0; k < c->count; k++)
+    {
+      if (mean_array[k].total == 0)
+        continue;
+      c->items[k].x = mean_array[k].mean_x / mean_array[k].total;
+      c->items[k].y = mean_array[k].mean_y / mean_array[k].total;
+    }
+  }
+
+  free(mean_array);
+  free(previous.items);
+}
+
+//--------------------------------------------------
+// Adjusted Rand index of two labelings with labels in [0, k), where
+// item i stands for weights[i] identical points.
+// Built from their k x k contingency table, so it costs O(n + k^2)
+//--------------------------------------------------
+double adjusted_rand_index(const int *a, const int *b, const int *weights, int n, int k, long *table)
+{
+  memset(table, 0, (size_t)k * k * sizeof(long));
+  double total = 0.0;
+  for (int i = 0; i < n; i++)
+  {
+    table[a[i] * k + b[i]] += weights[i];
+    total += weights[i];
+  }
+
+  double pairs = 0.0, pairs_a = 0.0, pairs_b = 0.0;
+  for (int i = 0; i < k; i++)
+  {
+    long row = 0, column = 0;
+    for (int j = 0; j < k; j++)
+    {
+      pairs += table[i * k + j] * (table[i * k + j] - 1) / 2.0;
+      row += table[i * k + j];
+      column += table[j * k + i];
+    }
+    pairs_a += row * (row - 1) / 2.0;
+    pairs_b += column * (column - 1) / 2.0;
+  }
+
+  double expected = pairs_a * pairs_b / (total * (total - 1.0) / 2.0);
+  double maximum = (pairs_a + pairs_b) / 2.0;
+  if (maximum == expected)
+    return 1.0;
+  return (pairs - expected) / (maximum - expected);
+}
+
+//--------------------------------------------------
+// Clustering stability for k: mean pairwise adjusted Rand index between
+// runs on bootstrap resamples. Each resample is an index view over the
+// samples and resamples run concurrently. Weighted samples are drawn in
+// proportion to their weight, as many times as there are points in total,
+// so the resample matches one of the data before deduplication. Every run
+// labels all samples with its final centroids so runs can be compared
+// point by point
+//--------------------------------------------------
+double stability_score(Samples *s, int k, int runs, unsigned int seed)
+{
+  int n = s->count;
+  int *labels = malloc((size_t)runs * n * sizeof(int));
+  int *weights = malloc(n * sizeof(int));
+  double *cumulative = malloc(n * sizeof(double));
+  if (labels == NULL || weights == NULL || cumulative == NULL || runs < 2 || n < 2)
+  {
+    free(labels);
+    free(weights);
+    free(cumulative);
+    return 0.0;
+  }
+
+  double running = 0.0;
+  for (int i = 0; i < n; i++)
+  {
+    weights[i] = s->items[i].weight;
+    running += weights[i];
+    cumulative[i] = running;
+  }
+  int draws = (int)running;
+
+#pragma omp parallel
+  {
+    int *index = malloc(draws * sizeof(int));
+    int *view_labels = malloc(draws * sizeof(int));
+    Centroids c = {malloc(k * sizeof(Vector2)), k, k};
+    assert(index != NULL && view_labels != NULL && c.items != NULL && "Buy more RAM lol");
+
+#pragma omp for schedule(dynamic, 1)
+    for (int r = 0; r < runs; r++)
+    {
+      unsigned int state = seed + r;
+      for (int i = 0; i < draws; i++)
+        index[i] = upper_bound(cumulative, n, (double)rand_r(&state) / RAND_MAX * running);
+      for (int j = 0; j < k; j++)
+      {
+        Sample pick = s->items[index[rand_r(&state) % draws]];
+        c.items[j] = (Vector2){pick.x, pick.y};
+      }
+      run_kmeans_view(&c, s, index, draws, view_labels);
+      for (int i = 0; i < n; i++)
+        labels[(size_t)r * n + i] = nearest_centroid(&c, s->items[i].x, s->items[i].y);
+    }
+
+    free(index);
+    free(view_labels);
+    free(c.items);
+  }
+
+  double total = 0.0;
+  int pairs = runs * (runs - 1) / 2;
+#pragma omp parallel reduction(+ : total)
+  {
+    long *table = malloc((size_t)k * k * sizeof(long));
+    assert(table != NULL && "Buy more RAM lol");
+#pragma omp for schedule(dynamic)
+    for (int p = 0; p < pairs; p++)
+    {
+      // Unrank p into the pair a < b
+      int a = 0, first = 0;
+      while (first + runs - 1 - a <= p)
+        first += runs - 1 - a++;
+      int b = a + 1 + (p - first);
+      total += adjusted_rand_index(&labels[(size_t)a * n], &labels[(size_t)b * n], weights, n, k, table);
+    }
+    free(table);
+  }
+
+  free(labels);
+  free(weights);
+  free(cumulative);
+  return total / pairs;
+}
+
+//--------------------------------------------------
+// Kmeans algorithm:
+// 1. Create k initial centroids randomly
+// 2. Create k clusters by associating each point with the nearest mean
+// 3. Update the centroids
+// 4. Repeat steps 2 and 3 until convergence
+//--------------------------------------------------
+#ifndef KMEANS_BENCH
+int main()
+{
+  InitWindow(800, 600, "Kmeans");
+  SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+
+  size_t num_samples = 25;
+  Vector2 center = (Vector2){
+      .x = WINDOW_WIDTH / 2,
+      .y = WINDOW_HEIGHT / 2};
+  double radius = 50.0;
+  Samples samples = {0};
+
+  generate_samples(&samples, center, num_samples, radius);
+
+  center.y += center.y / 2;
+  generate_samples(&samples, center, num_samples, radius);
+
+  center.x += center.x / 2;
+  generate_samples(&samples, center, num_samples, radius);
+
+  center.x -= center.x * 0.7;
+  generate_samples(&samples, center, num_samples, radius);
+
+  // Identical samples are clustered once, weighted by how often they
+  // appear, and their labels are copied back to the original rows
+  Samples unique = {0};
+  int *mapping = NULL;
+  if (DEDUPLICATE)
+  {
+    mapping = malloc(samples.count * sizeof(int));
+    if (mapping != NULL && !dedup_samples(&samples, &unique, mapping))
+    {
+      free(mapping);
+      mapping = NULL;
+    }
+  }
+  Samples *clustered = mapping != NULL ? &unique : &samples;
+
+  // Values close to 1 mean the clustering barely changes between resamples
+  for (int k = 2; STABILITY_RUNS > 0 && k <= STABILITY_MAX_K; k++)
+    printf("k = %d, stability = %.3f\n", k, stability_score(clustered, k, STABILITY_RUNS, time(NULL)));
+
+  Centroids centroids = {0};
+  if (AFKMC2_SEEDING)
+    afkmc2_centroids(&centroids, clustered, 3, AFKMC2_CHAIN_LENGTH);
+  else
+    create_centroids(&centroids, 3);
+
+  float dt;
+  float time_between_updates = 0.0f;
+
+  Centroids previus;
+  while (!WindowShouldClose())
+  {
+    dt = GetFrameTime();
+    time_between_updates += dt;
+
+    BeginDrawing();
+    ClearBackground(RAYWHITE);
+    draw_centroids(&centroids);
+    draw_samples(&samples);
+    run_kmeans(&centroids, clustered, &time_between_updates);
+    if (mapping != NULL)
+      expand_labels(&unique, mapping, &samples);
+    EndDrawing();
+  }
+
+  CloseWindow();
+  free(mapping);
+  free(unique.items);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,213 @@
+/*
+https://www.kernel.org/doc/html/latest/locking/seqlock.html
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "model.h"
+
+//--------------------------------------------------
+// Opens or creates the segment behind name and maps it writable. A new
+// segment starts with an odd sequence, so readers wait until the first
+// publish has filled it. A segment too small for bytes is unlinked and
+// returned in retired, still mapped: a new one with exactly the needed
+// size takes over the name and the version numbers, and the caller
+// retires the old one once the new one is published
+//--------------------------------------------------
+SharedModel *map_for_publish(const char *name, size_t bytes, size_t *size,
+                             SharedModel **retired, size_t *retired_size)
+{
+  *retired = NULL;
+  uint64_t version = 0;
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      break;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      break;
+    }
+    bool fresh = st.st_size == 0;
+    *size = fresh ? sizeof(SharedModel) + bytes : (size_t)st.st_size;
+    if (fresh && ftruncate(fd, *size) != 0)
+    {
+      close(fd);
+      break;
+    }
+
+    SharedModel *model = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (model == MAP_FAILED)
+      break;
+
+    if (fresh)
+    {
+      model->capacity = bytes;
+      model->version = version;
+      atomic_store(&model->sequence, 1);
+      atomic_store(&model->retired, 0);
+      atomic_thread_fence(memory_order_release);
+      model->magic = MODEL_MAGIC;
+    }
+    if (model->magic == MODEL_MAGIC && model->capacity >= bytes &&
+        *size >= sizeof(SharedModel) + model->capacity)
+      return model;
+
+    if (model->magic == MODEL_MAGIC && *retired == NULL)
+    {
+      version = model->version;
+      *retired = model;
+      *retired_size = *size;
+    }
+    else
+      munmap(model, *size);
+    shm_unlink(name);
+  }
+
+  if (*retired != NULL)
+  {
+    munmap(*retired, *retired_size);
+    *retired = NULL;
+  }
+  return NULL;
+}
+
+//--------------------------------------------------
+// Publishes count rows of row_size bytes under name, which starts with
+// a slash. Only one process may publish to a given name
+//--------------------------------------------------
+bool model_publish(const char *name, const void *rows, int count, int row_size)
+{
+  size_t bytes = (size_t)count * row_size;
+  size_t size, retired_size;
+  SharedModel *retired;
+  SharedModel *model = map_for_publish(name, bytes, &size, &retired, &retired_size);
+  if (model == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't map shared memory %s on model_publish method\n", name);
+    return false;
+  }
+
+  // A new segment is already marked as being written
+  uint64_t sequence = atomic_load_explicit(&model->sequence, memory_order_relaxed);
+  if ((sequence & 1) == 0)
+    atomic_store_explicit(&model->sequence, ++sequence, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(model->data, rows, bytes);
+  model->rows = count;
+  model->row_size = row_size;
+  model->version++;
+  atomic_store_explicit(&model->sequence, sequence + 1, memory_order_release);
+
+  if (retired != NULL)
+  {
+    atomic_store(&retired->retired, 1);
+    munmap(retired, retired_size);
+  }
+  munmap(model, size);
+  return true;
+}
+
+//--------------------------------------------------
+// Maps a published model read-only
+//--------------------------------------------------
+bool model_open(ModelMapping *m, const char *name)
+{
+  *m = (ModelMapping){0};
+  snprintf(m->name, sizeof(m->name), "%s", name);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SharedModel))
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  m->model = data;
+  m->size = st.st_size;
+  if (m->model->magic != MODEL_MAGIC || m->size < sizeof(SharedModel) + m->model->capacity)
+  {
+    model_close(m);
+    return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------
+// Sequence to pass to model_read_retry, waits out a publish in progress
+//--------------------------------------------------
+uint64_t model_read_begin(const ModelMapping *m)
+{
+  uint64_t sequence;
+  while ((sequence = atomic_load_explicit(&m->model->sequence, memory_order_acquire)) & 1)
+    sched_yield();
+  return sequence;
+}
+
+//--------------------------------------------------
+// True when the model changed since model_read_begin, so what was read
+// must be thrown away
+//--------------------------------------------------
+bool model_read_retry(const ModelMapping *m, uint64_t sequence)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&m->model->sequence, memory_order_relaxed) != sequence;
+}
+
+//--------------------------------------------------
+// Copies a consistent snapshot of the model into rows, which holds
+// capacity bytes. Follows the model to its new segment when it was retired
+//--------------------------------------------------
+bool model_copy(ModelMapping *m, void *rows, size_t capacity, int *count, int *row_size, uint64_t *version)
+{
+  for (;;)
+  {
+    if (m->model == NULL || atomic_load(&m->model->retired))
+    {
+      char name[sizeof(m->name)];
+      memcpy(name, m->name, sizeof(name));
+      model_close(m);
+      if (!model_open(m, name))
+        return false;
+    }
+
+    uint64_t sequence = model_read_begin(m);
+    int32_t r = m->model->rows;
+    int32_t size = m->model->row_size;
+    uint64_t v = m->model->version;
+    size_t bytes = (size_t)r * size;
+    bool fits = r >= 0 && size >= 0 && bytes <= m->model->capacity && bytes <= capacity;
+    if (fits)
+      memcpy(rows, m->model->data, bytes);
+    if (model_read_retry(m, sequence))
+      continue;
+    if (!fits)
+      return false;
+
+    *count = r;
+    *row_size = size;
+    *version = v;
+    return true;
+  }
+}
+
+void model_close(ModelMapping *m)
+{
+  if (m->model != NULL)
+    munmap((void *)m->model, m->size);
+  m->model = NULL;
+  m->size = 0;
+}
@@ -0,0 +1,45 @@
+/*
+Publishing trained centroids in a named POSIX shared-memory segment.
+One process publishes, any number of processes map the segment read-only
+and use the rows in place. Swaps are protected by a seqlock: readers take
+the sequence with model_read_begin, read, and start again when
+model_read_retry says a publish happened meanwhile
+*/
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MODEL_MAGIC 0x4b4d4f31 // "KMO1", layout version of SharedModel
+
+typedef struct
+{
+  uint32_t magic;
+  _Atomic uint32_t retired;  // Set when a larger model moved to a new segment
+  _Atomic uint64_t sequence; // Odd while a publish is in progress
+  uint64_t version;          // Number of publishes so far
+  uint64_t capacity;         // Bytes available in data
+  int32_t rows;
+  int32_t row_size;
+  unsigned char data[]; // rows * row_size bytes, one centroid per row
+} SharedModel;
+
+typedef struct
+{
+  const SharedModel *model;
+  size_t size;
+  char name[256];
+} ModelMapping;
+
+bool model_publish(const char *name, const void *rows, int count, int row_size);
+bool model_open(ModelMapping *m, const char *name);
+uint64_t model_read_begin(const ModelMapping *m);
+bool model_read_retry(const ModelMapping *m, uint64_t sequence);
+bool model_copy(ModelMapping *m, void *rows, size_t capacity, int *count, int *row_size, uint64_t *version);
+void model_close(ModelMapping *m);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+CPython bindings for the k-majority, k-modes and DTW engines.
+Input arrays are used in place through the buffer protocol, results are
+returned as arrays viewing memory allocated by the engines
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hamming.h"
+#include "../kmodes.h"
+#include "../dtw.h"
+
+//--------------------------------------------------
+// Owner of memory allocated by the engines, exported as a 1D or 2D buffer
+//--------------------------------------------------
+typedef struct
+{
+  PyObject_HEAD void *data;
+  int ndim;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+  Py_ssize_t itemsize;
+  char *format;
+} LibraryArray;
+
+static int library_array_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+  LibraryArray *array = (LibraryArray *)self;
+  view->obj = Py_NewRef(self);
+  view->buf = array->data;
+  view->len = array->shape[0] * (array->ndim == 2 ? array->shape[1] : 1) * array->itemsize;
+  view->readonly = 0;
+  view->itemsize = array->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? array->format : NULL;
+  view->ndim = array->ndim;
+  view->shape = array->shape;
+  view->strides = array->ndim == 2 ? array->strides : &array->strides[1];
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static void library_array_dealloc(PyObject *self)
+{
+  free(((LibraryArray *)self)->data);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyBufferProcs library_array_as_buffer = {
+    .bf_getbuffer = library_array_getbuffer,
+};
+
+static PyTypeObject LibraryArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "kmeans.LibraryArray",
+    .tp_basicsize = sizeof(LibraryArray),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = library_array_dealloc,
+    .tp_as_buffer = &library_array_as_buffer,
+    .tp_doc = "Array memory owned by the clustering engines",
+};
+
+//--------------------------------------------------
+// Wraps engine memory without copying. Returns a numpy array when numpy
+// is installed and a memoryview otherwise. Takes ownership of data.
+// ndim 1 is only meant for a single column such as the labels
+//--------------------------------------------------
+static PyObject *wrap_array(void *data, int ndim, Py_ssize_t rows, Py_ssize_t columns, Py_ssize_t itemsize, char *format)
+{
+  LibraryArray *array = PyObject_New(LibraryArray, &LibraryArrayType);
+  if (array == NULL)
+  {
+    free(data);
+    return NULL;
+  }
+  array->data = data;
+  array->ndim = ndim;
+  array->shape[0] = rows;
+  array->shape[1] = columns;
+  array->strides[0] = columns * itemsize;
+  array->strides[1] = itemsize;
+  array->itemsize = itemsize;
+  array->format = format;
+
+  PyObject *result;
+  PyObject *numpy = PyImport_ImportModule("numpy");
+  if (numpy != NULL)
+  {
+    result = PyObject_CallMethod(numpy, "asarray", "O", (PyObject *)array);
+    Py_DECREF(numpy);
+  }
+  else
+  {
+    PyErr_Clear();
+    result = PyMemoryView_FromObject((PyObject *)array);
+  }
+  Py_DECREF(array);
+  return result;
+}
+
+//--------------------------------------------------
+// Borrows a C contiguous 2D buffer whose items match format and itemsize
+//--------------------------------------------------
+static int get_matrix(PyObject *object, Py_buffer *view, const char *formats, Py_ssize_t itemsize, int writable)
+{
+  int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+  if (PyObject_GetBuffer(object, view, flags) < 0)
+    return -1;
+
+  const char *format = view->format;
+  if (format[0] == '<' || format[0] == '=' || format[0] == '@')
+    format++;
+  if (view->ndim != 2 || view->itemsize != itemsize || strlen(format) != 1 || strchr(formats, format[0]) == NULL)
+  {
+    PyErr_Format(PyExc_TypeError, "expected a C contiguous 2D array of %zd byte items ('%s')", itemsize, formats);
+    PyBuffer_Release(view);
+    return -1;
+  }
+  if (view->shape[0] == 0 || view->shape[0] > __INT_MAX__ || view->shape[1] > __INT_MAX__)
+  {
+    PyErr_SetString(PyExc_ValueError, "array must have between 1 and INT_MAX rows");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  // The engines read the first and last column of every row
+  if (view->shape[1] == 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "array must have at least 1 column");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *labels_and_centroids(int *labels, Py_ssize_t count, void *centroids, Py_ssize_t k,
+                                      Py_ssize_t columns, Py_ssize_t itemsize, char *format)
+{
+  // Centroids stay 2D even with one column, so they can be passed back in
+  PyObject *labels_array = wrap_array(labels, 1, count, 1, sizeof(int), "i");
+  PyObject *centroids_array = wrap_array(centroids, 2, k, columns, itemsize, format);
+  if (labels_array == NULL || centroids_array == NULL)
+  {
+    Py_XDECREF(labels_array);
+    Py_XDECREF(centroids_array);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", labels_array, centroids_array);
+}
+
+//--------------------------------------------------
+// kmajority(bits, k) with bits a (n, words) uint64 array
+//--------------------------------------------------
+static PyObject *py_kmajority(PyObject *self, PyObject *args)
+{
+  (void)self;
+  PyObject *object;
+  int k;
+  if (!PyArg_ParseTuple(args, "Oi", &object, &k))
+    return NULL;
+
+  Py_buffer view;
+  if (get_matrix(object, &view, "QLK", 8, 0) < 0)
+    return NULL;
+  if (k <= 0 || k > view.shape[0])
+  {
+    PyBuffer_Release(&view);
+    return PyErr_Format(PyExc_ValueError, "k must be between 1 and the number of samples");
+  }
+
+  BinarySamples samples = {
+      .items = view.buf,
+      .clusters = malloc(view.shape[0] * sizeof(int)),
+      .words = (int)view.shape[1],
+      .count = (int)view.shape[0],
+      .capacity = (int)view.shape[0],
+  };
+  if (samples.clusters == NULL)
+  {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+  BinaryCentroids centroids;
+
+  Py_BEGIN_ALLOW_THREADS;
+  create_binary_centroids(&centroids, &samples, k);
+  run_kmajority(&centroids, &samples);
+  Py_END_ALLOW_THREADS;
+
+  PyBuffer_Release(&view);
+  return labels_and_centroids(samples.clusters, samples.count, centroids.items, k,
+                              centroids.words, sizeof(uint64_t), "Q");
+}
+
+//--------------------------------------------------
+// kmodes(codes, k) with codes a (n, attributes) uint8 array
+//--------------------------------------------------
+static PyObject *py_kmodes(PyObject *self, PyObject *args)
+{
+  (void)self;
+  PyObject *object;
+  int k;
+  if (!PyArg_ParseTuple(args, "Oi", &object, &k))
+    return NULL;
+
+  Py_buffer view;
+  if (get_matrix(object, &view, "B", 1, 0) < 0)
+    return NULL;
+  if (k <= 0 || k > view.shape[0])
+  {
+    PyBuffer_Release(&view);
+    return PyErr_Format(PyExc_ValueError, "k must be between 1 and the number of samples");
+  }
+
+  CategoricalSamples samples = {
+      .items = view.buf,
+      .clusters = malloc(view.shape[0] * sizeof(int)),
+      .attributes = (int)view.shape[1],
+      .count = (int)view.shape[0],
+      .capacity = (int)view.shape[0],
+  };
+  if (samples.clusters == NULL)
+  {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+  Modes modes;
+
+  Py_BEGIN_ALLOW_THREADS;
+  create_modes(&modes, &samples, k);
+  run_kmodes(&modes, &samples);
+  Py_END_ALLOW_THREADS;
+
+  PyBuffer_Release(&view);
+  return labels_and_centroids(samples.clusters, samples.count, modes.items, k,
+                              modes.attributes, 1, "B");
+}
+
+//--------------------------------------------------
+// dtw_kmeans(series, k, window) with series a (n, length) float32 array
+//--------------------------------------------------
+static PyObject *py_dtw_kmeans(PyObject *self, PyObject *args)
+{
+  (void)self;
+  PyObject *object;
+  int k;
+  int window;
+  if (!PyArg_ParseTuple(args, "Oii", &object, &k, &window))
+    return NULL;
+
+  Py_buffer view;
+  if (get_matrix(object, &view, "f", sizeof(float), 0) < 0)
+    return NULL;
+  if (k <= 0 || k > view.shape[0] || window < 0)
+  {
+    PyBuffer_Release(&view);
+    return PyErr_Format(PyExc_ValueError, "k must be between 1 and the number of series and window not negative");
+  }
+
+  Series series = {
+      .items = view.buf,
+      .clusters = malloc(view.shape[0] * sizeof(int)),
+      .length = (int)view.shape[1],
+      .count = (int)view.shape[0],
+      .capacity = (int)view.shape[0],
+  };
+  if (series.clusters == NULL)
+  {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+  for (int i = 0; i < series.count; i++)
+    series.clusters[i] = -1;
+  SeriesCentroids centroids;
+
+  Py_BEGIN_ALLOW_THREADS;
+  create_series_centroids(&centroids, &series, k);
+  run_dtw_kmeans(&centroids, &series, window);
+  Py_END_ALLOW_THREADS;
+
+  PyBuffer_Release(&view);
+  return labels_and_centroids(series.clusters, series.count, centroids.items, k,
+                              centroids.length, sizeof(float), "f");
+}
+
+static PyMethodDef kmeans_methods[] = {
+    {"kmajority", py_kmajority, METH_VARARGS, "kmajority(bits, k) -> (labels, centroids)"},
+    {"kmodes", py_kmodes, METH_VARARGS, "kmodes(codes, k) -> (labels, modes)"},
+    {"dtw_kmeans", py_dtw_kmeans, METH_VARARGS, "dtw_kmeans(series, k, window) -> (labels, centroids)"},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef kmeans_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "kmeans",
+    .m_doc = "k-means engines working in place on buffer protocol arrays",
+    .m_size = -1,
+    .m_methods = kmeans_methods,
+};
+
+PyMODINIT_FUNC PyInit_kmeans(void)
+{
+  if (PyType_Ready(&LibraryArrayType) < 0)
+    return NULL;
+  return PyModule_Create(&kmeans_module);
+}
@@ -0,0 +1,436 @@
+/*
+Runs a batch of clustering jobs read from a job file.
+Each line describes one job:
+
+  <engine> <dataset> <columns> <k> <seed> [window]
+
+engine is kmajority (uint64 columns), kmodes (uint8 columns) or dtw
+(float32 columns). window is the +-steps band of dtw and defaults to
+columns, which means no band. Datasets are raw row-major files,
+optionally gzip or zstd compressed, loaded once and kept in a small LRU cache shared by
+all jobs. Jobs run concurrently,
+most expensive first, and each one writes <output dir>/job-<line>.txt.
+With a publish prefix the centroids of each job are also published in
+shared memory as /<prefix>-job-<line>, see model.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "ingest.h"
+#include "hamming.h"
+#include "kmodes.h"
+#include "dtw.h"
+#include "model.h"
+
+#define INITIAL_CAPACITY 10
+#define CACHE_SIZE 4
+#define MAX_PATH 512
+
+#define da_append(array, item)                                               \
+  do                                                                         \
+  {                                                                          \
+    if ((array)->count >= (array)->capacity)                                 \
+    {                                                                        \
+      (array)->capacity =                                                    \
+          (array)->capacity == 0 ? INITIAL_CAPACITY : (array)->capacity * 2; \
+      (array)->items = realloc((array)->items,                               \
+                               (array)->capacity * sizeof(*(array)->items)); \
+      assert((array)->items != NULL && "Buy more RAM lol");                  \
+    }                                                                        \
+    (array)->items[(array)->count++] = (item);                               \
+  } while (0)
+
+typedef enum
+{
+  ENGINE_KMAJORITY,
+  ENGINE_KMODES,
+  ENGINE_DTW,
+} Engine;
+
+typedef struct
+{
+  int line;
+  Engine engine;
+  char dataset[MAX_PATH];
+  int columns;
+  int k;
+  unsigned int seed;
+  int window;
+  double cost;
+} Job;
+
+typedef struct
+{
+  Job *items;
+  int count;
+  int capacity;
+} Jobs;
+
+typedef struct
+{
+  char path[MAX_PATH];
+  void *data;
+  size_t size;
+  bool mapped;
+  bool loading;   // A job is loading path into this entry without the lock
+  int users;      // Jobs currently reading the data
+  long last_used; // Cache clock value of the last lookup
+} Dataset;
+
+typedef struct
+{
+  Dataset entries[CACHE_SIZE];
+  long clock;
+  int loads;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // Signalled when an entry loses its last user or finishes loading
+} DatasetCache;
+
+//--------------------------------------------------
+// Size in bytes of one column of an engine
+//--------------------------------------------------
+size_t column_size(Engine engine)
+{
+  switch (engine)
+  {
+  case ENGINE_KMAJORITY:
+    return sizeof(uint64_t);
+  case ENGINE_KMODES:
+    return sizeof(uint8_t);
+  case ENGINE_DTW:
+    return sizeof(float);
+  }
+  return 1;
+}
+
+//--------------------------------------------------
+// Reads the job file. Blank lines and lines starting with # are skipped
+//--------------------------------------------------
+bool read_jobs(const char *path, Jobs *jobs)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not open job file %s\n", path);
+    return false;
+  }
+
+  char line[1024];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    line_number++;
+    char engine[32];
+    Job job = {.line = line_number};
+    if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    int fields = sscanf(line, "%31s %511s %d %d %u %d", engine, job.dataset,
+                        &job.columns, &job.k, &job.seed, &job.window);
+    if (fields == 5)
+      job.window = job.columns;
+    if (fields < 5 || job.columns <= 0 || job.k <= 0 || job.window < 0)
+    {
+      fprintf(stderr, "ERROR: %s:%d: expected <engine> <dataset> <columns> <k> <seed> [window]\n", path, line_number);
+      fclose(file);
+      return false;
+    }
+    if (strcmp(engine, "kmajority") == 0)
+      job.engine = ENGINE_KMAJORITY;
+    else if (strcmp(engine, "kmodes") == 0)
+      job.engine = ENGINE_KMODES;
+    else if (strcmp(engine, "dtw") == 0)
+      job.engine = ENGINE_DTW;
+    else
+    {
+      fprintf(stderr, "ERROR: %s:%d: unknown engine %s\n", path, line_number, engine);
+      fclose(file);
+      return false;
+    }
+    da_append(jobs, job);
+  }
+
+  fclose(file);
+  return true;
+}
+
+//--------------------------------------------------
+// Rough cost of one iteration, used to start the longest jobs first
+//--------------------------------------------------
+void estimate_cost(Job *job)
+{
+  double rows = (double)dataset_size(job->dataset) / (job->columns * column_size(job->engine));
+  double per_distance = job->columns;
+  if (job->engine == ENGINE_DTW)
+    per_distance *= 2 * job->window + 1 < job->columns ? 2 * job->window + 1 : job->columns;
+  job->cost = rows * job->k * per_distance;
+}
+
+int compare_cost(const void *a, const void *b)
+{
+  double ca = ((const Job *)a)->cost;
+  double cb = ((const Job *)b)->cost;
+  return (ca < cb) - (ca > cb);
+}
+
+//--------------------------------------------------
+// Returns a cached dataset, loading it on a miss.
+// When the cache is full the least recently used unused entry is freed,
+// and when every entry is in use the job waits for one to be released.
+// The load itself runs without the lock, so other jobs keep hitting the
+// cache meanwhile and only the ones wanting the same dataset wait for it
+//--------------------------------------------------
+Dataset *acquire_dataset(DatasetCache *cache, const char *path)
+{
+  Dataset *dataset = NULL;
+  pthread_mutex_lock(&cache->lock);
+  for (;;)
+  {
+    Dataset *victim = NULL;
+    for (int i = 0; i < CACHE_SIZE && dataset == NULL; i++)
+    {
+      Dataset *entry = &cache->entries[i];
+      if ((entry->data != NULL || entry->loading) && strcmp(entry->path, path) == 0)
+        dataset = entry;
+      else if (entry->users == 0 && (victim == NULL || entry->data == NULL ||
+                                     (victim->data != NULL && entry->last_used < victim->last_used)))
+        victim = entry;
+    }
+
+    if (dataset != NULL && dataset->loading)
+    {
+      dataset = NULL;
+      pthread_cond_wait(&cache->changed, &cache->lock);
+      continue;
+    }
+    if (dataset == NULL && victim == NULL)
+    {
+      pthread_cond_wait(&cache->changed, &cache->lock);
+      continue;
+    }
+    if (dataset != NULL)
+    {
+      dataset->users++;
+      dataset->last_used = cache->clock++;
+      break;
+    }
+
+    // Claim the victim, its user keeps it from being picked again
+    void *old_data = victim->data;
+    size_t old_size = victim->size;
+    bool old_mapped = victim->mapped;
+    victim->data = NULL;
+    victim->loading = true;
+    victim->users = 1;
+    strncpy(victim->path, path, MAX_PATH - 1);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (old_data != NULL)
+      free_dataset(old_data, old_size, old_mapped);
+    size_t size = 0;
+    bool mapped = false;
+    void *data = load_dataset(path, &size, &mapped);
+
+    pthread_mutex_lock(&cache->lock);
+    victim->loading = false;
+    if (data != NULL)
+    {
+      victim->data = data;
+      victim->size = size;
+      victim->mapped = mapped;
+      victim->last_used = cache->clock++;
+      cache->loads++;
+      dataset = victim;
+    }
+    else
+    {
+      fprintf(stderr, "ERROR: Could not load dataset %s\n", path);
+      victim->path[0] = '\0';
+      victim->users = 0;
+    }
+    pthread_cond_broadcast(&cache->changed);
+    break;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return dataset;
+}
+
+void release_dataset(DatasetCache *cache, Dataset *dataset)
+{
+  pthread_mutex_lock(&cache->lock);
+  if (--dataset->users == 0)
+    pthread_cond_broadcast(&cache->changed);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------
+// Copies k rows picked with the job seed as initial centroids
+//--------------------------------------------------
+void *seed_centroids(const Job *job, const void *data, int rows)
+{
+  size_t row_size = job->columns * column_size(job->engine);
+  char *centroids = malloc(job->k * row_size);
+  if (centroids == NULL)
+    return NULL;
+  unsigned int seed = job->seed;
+  for (int i = 0; i < job->k; i++)
+    memcpy(&centroids[i * row_size], (const char *)data + (size_t)(rand_r(&seed) % rows) * row_size, row_size);
+  return centroids;
+}
+
+//--------------------------------------------------
+// Writes centroids, one per line, followed by the label of every row
+//--------------------------------------------------
+void write_result(const char *output_dir, const Job *job, const void *centroids, const int *labels,
+                  int rows, double seconds)
+{
+  char path[MAX_PATH + 32];
+  snprintf(path, sizeof(path), "%s/job-%d.txt", output_dir, job->line);
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not write %s\n", path);
+    return;
+  }
+
+  fprintf(file, "# dataset=%s k=%d seed=%u rows=%d seconds=%f\n", job->dataset, job->k, job->seed, rows, seconds);
+  for (int c = 0; c < job->k; c++)
+  {
+    for (int j = 0; j < job->columns; j++)
+    {
+      size_t at = (size_t)c * job->columns + j;
+      if (job->engine == ENGINE_KMAJORITY)
+        fprintf(file, "%s%016llx", j ? " " : "", (unsigned long long)((const uint64_t *)centroids)[at]);
+      else if (job->engine == ENGINE_KMODES)
+        fprintf(file, "%s%d", j ? " " : "", ((const uint8_t *)centroids)[at]);
+      else
+        fprintf(file, "%s%g", j ? " " : "", ((const float *)centroids)[at]);
+    }
+    fprintf(file, "\n");
+  }
+  for (int i = 0; i < rows; i++)
+    fprintf(file, "%d\n", labels[i]);
+  fclose(file);
+}
+
+//--------------------------------------------------
+// Runs one job on a cached dataset, returns false when it could not run
+//--------------------------------------------------
+bool run_job(DatasetCache *cache, const Job *job, const char *output_dir, const char *prefix)
+{
+  Dataset *dataset = acquire_dataset(cache, job->dataset);
+  if (dataset == NULL)
+    return false;
+
+  // The engines count rows in an int
+  size_t total_rows = dataset->size / (job->columns * column_size(job->engine));
+  if (total_rows > __INT_MAX__)
+  {
+    fprintf(stderr, "ERROR: Dataset %s of job on line %d has more than INT_MAX rows\n", job->dataset, job->line);
+    release_dataset(cache, dataset);
+    return false;
+  }
+  int rows = (int)total_rows;
+  int *labels = malloc(rows * sizeof(int));
+  void *centroids = rows >= job->k ? seed_centroids(job, dataset->data, rows) : NULL;
+  if (labels == NULL || centroids == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not run job on line %d\n", job->line);
+    free(labels);
+    free(centroids);
+    release_dataset(cache, dataset);
+    return false;
+  }
+  for (int i = 0; i < rows; i++)
+    labels[i] = -1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (job->engine == ENGINE_KMAJORITY)
+  {
+    BinarySamples s = {dataset->data, labels, job->columns, rows, rows};
+    BinaryCentroids c = {centroids, job->columns, job->k};
+    run_kmajority(&c, &s);
+  }
+  else if (job->engine == ENGINE_KMODES)
+  {
+    CategoricalSamples s = {dataset->data, labels, job->columns, rows, rows};
+    Modes m = {centroids, job->columns, job->k};
+    run_kmodes(&m, &s);
+  }
+  else
+  {
+    Series s = {dataset->data, labels, job->columns, rows, rows};
+    SeriesCentroids c = {centroids, job->columns, job->k};
+    run_dtw_kmeans(&c, &s, job->window);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  release_dataset(cache, dataset);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  write_result(output_dir, job, centroids, labels, rows, seconds);
+  if (prefix != NULL)
+  {
+    char name[MAX_PATH];
+    snprintf(name, sizeof(name), "/%s-job-%d", prefix, job->line);
+    model_publish(name, centroids, job->k, job->columns * column_size(job->engine));
+  }
+  printf("job %d: %s k=%d %.3fs\n", job->line, job->dataset, job->k, seconds);
+  free(labels);
+  free(centroids);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3 && argc != 4)
+  {
+    fprintf(stderr, "Usage: %s <job file> <output dir> [publish prefix]\n", argv[0]);
+    return 1;
+  }
+
+  Jobs jobs = {0};
+  if (!read_jobs(argv[1], &jobs))
+    return 1;
+
+  for (int i = 0; i < jobs.count; i++)
+    estimate_cost(&jobs.items[i]);
+  qsort(jobs.items, jobs.count, sizeof(Job), compare_cost);
+
+  DatasetCache cache = {0};
+  pthread_mutex_init(&cache.lock, NULL);
+  pthread_cond_init(&cache.changed, NULL);
+
+  // Compressed datasets are loaded up front, while decompression can
+  // still use every thread
+  for (int i = 0; i < jobs.count; i++)
+  {
+    const char *extension = strrchr(jobs.items[i].dataset, '.');
+    if (extension == NULL || (strcmp(extension, ".gz") != 0 && strcmp(extension, ".zst") != 0))
+      continue;
+    if (cache.loads >= CACHE_SIZE)
+      break;
+    Dataset *dataset = acquire_dataset(&cache, jobs.items[i].dataset);
+    if (dataset != NULL)
+      release_dataset(&cache, dataset);
+  }
+
+  int failed = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : failed)
+  for (int i = 0; i < jobs.count; i++)
+    failed += !run_job(&cache, &jobs.items[i], argv[2], argc == 4 ? argv[3] : NULL);
+
+  for (int i = 0; i < CACHE_SIZE; i++)
+    if (cache.entries[i].data != NULL)
+      free_dataset(cache.entries[i].data, cache.entries[i].size, cache.entries[i].mapped);
+  printf("%d jobs, %d failed, %d dataset loads\n", jobs.count, failed, cache.loads);
+  pthread_mutex_destroy(&cache.lock);
+  pthread_cond_destroy(&cache.changed);
+  free(jobs.items);
+  return failed > 0;
+}
@@ -0,0 +1,13 @@
+from setuptools import Extension, setup
+
+setup(
+    name="kmeans",
+    ext_modules=[
+        Extension(
+            "kmeans",
+            sources=["python/kmeansmodule.c", "hamming.c", "kmodes.c", "dtw.c"],
+            extra_compile_args=["-fopenmp"],
+            extra_link_args=["-fopenmp"],
+        )
+    ],
+)
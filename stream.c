@@ -0,0 +1,163 @@
+/*
+https://en.wikipedia.org/wiki/K-means_clustering#Variations
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+
+#define STREAM_RING 4096  // Points per producer ring, a power of two
+#define STREAM_BATCH 1024 // Points assigned together by stream_poll
+
+//--------------------------------------------------
+// Prepares k centroids of dims values fed by the given number of producers
+//--------------------------------------------------
+bool stream_init(StreamClusterer *s, int k, int dims, int producers)
+{
+  memset(s, 0, sizeof(*s));
+  s->k = k;
+  s->dims = dims;
+  s->producers = producers;
+  s->shards = aligned_alloc(_Alignof(StreamShard), producers * sizeof(StreamShard));
+  s->centroids = malloc((size_t)k * dims * sizeof(float));
+  s->counts = calloc(k, sizeof(long));
+  s->batch = malloc((size_t)STREAM_BATCH * dims * sizeof(float));
+  s->labels = malloc(STREAM_BATCH * sizeof(int));
+  s->distances = malloc(2 * STREAM_BATCH * sizeof(float));
+  if (s->shards == NULL || s->centroids == NULL || s->counts == NULL || s->batch == NULL ||
+      s->labels == NULL || s->distances == NULL)
+  {
+    fprintf(stderr, "ERROR: Can't allocate memory on stream_init method\n");
+    s->producers = 0;
+    stream_free(s);
+    return false;
+  }
+
+  for (int p = 0; p < producers; p++)
+  {
+    atomic_init(&s->shards[p].head, 0);
+    atomic_init(&s->shards[p].tail, 0);
+    s->shards[p].items = malloc((size_t)STREAM_RING * dims * sizeof(float));
+    if (s->shards[p].items == NULL)
+    {
+      fprintf(stderr, "ERROR: Can't allocate memory for the rings on stream_init method\n");
+      s->producers = p + 1;
+      stream_free(s);
+      return false;
+    }
+  }
+  return true;
+}
+
+//--------------------------------------------------
+// Queues up to count points from one producer thread, each producer
+// using its own index. Returns how many fit; a full ring is the
+// backpressure signal, the rest should be pushed again later or dropped
+//--------------------------------------------------
+int stream_push(StreamClusterer *s, int producer, const float *points, int count)
+{
+  StreamShard *shard = &s->shards[producer];
+  size_t head = atomic_load_explicit(&shard->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&shard->tail, memory_order_acquire);
+  size_t space = STREAM_RING - (head - tail);
+  int accepted = (size_t)count < space ? count : (int)space;
+
+  for (int i = 0; i < accepted; i++)
+    memcpy(&shard->items[((head + i) & (STREAM_RING - 1)) * s->dims], &points[(size_t)i * s->dims],
+           s->dims * sizeof(float));
+  atomic_store_explicit(&shard->head, head + accepted, memory_order_release);
+  return accepted;
+}
+
+//--------------------------------------------------
+// Moves up to STREAM_BATCH queued points into the batch, taking from the
+// rings in turn so a busy producer can not starve the others. The batch
+// stores each dimension contiguously so the assignment vectorizes
+//--------------------------------------------------
+int gather_batch(StreamClusterer *s)
+{
+  int filled = 0;
+  for (int visited = 0; visited < s->producers && filled < STREAM_BATCH; visited++)
+  {
+    StreamShard *shard = &s->shards[s->next_shard];
+    s->next_shard = (s->next_shard + 1) % s->producers;
+    size_t tail = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&shard->head, memory_order_acquire);
+    int take = head - tail < (size_t)(STREAM_BATCH - filled) ? (int)(head - tail) : STREAM_BATCH - filled;
+
+    for (int i = 0; i < take; i++)
+      for (int d = 0; d < s->dims; d++)
+        s->batch[(size_t)d * STREAM_BATCH + filled + i] = shard->items[((tail + i) & (STREAM_RING - 1)) * s->dims + d];
+    atomic_store_explicit(&shard->tail, tail + take, memory_order_release);
+    filled += take;
+  }
+  return filled;
+}
+
+//--------------------------------------------------
+// Clusters one batch of queued points, called from a single consumer
+// thread. The first k points become the centroids, the others are
+// assigned together against the current centroids and then each one
+// moves its centroid by 1 / count of the way towards it.
+// Returns the number of points processed, 0 when the rings are empty
+//--------------------------------------------------
+int stream_poll(StreamClusterer *s)
+{
+  int count = gather_batch(s);
+  int first = 0;
+  while (s->seeded < s->k && first < count)
+  {
+    for (int d = 0; d < s->dims; d++)
+      s->centroids[(size_t)s->seeded * s->dims + d] = s->batch[(size_t)d * STREAM_BATCH + first];
+    s->counts[s->seeded++] = 1;
+    first++;
+  }
+
+  int *labels = s->labels;
+  float *best = s->distances;
+  float *distance = s->distances + STREAM_BATCH;
+  for (int i = first; i < count; i++)
+    best[i] = __FLT_MAX__;
+  for (int j = 0; j < s->seeded; j++)
+  {
+    const float *centroid = &s->centroids[(size_t)j * s->dims];
+    for (int i = first; i < count; i++)
+      distance[i] = 0.0f;
+    for (int d = 0; d < s->dims; d++)
+    {
+      const float *values = &s->batch[(size_t)d * STREAM_BATCH];
+#pragma omp simd
+      for (int i = first; i < count; i++)
+        distance[i] += (values[i] - centroid[d]) * (values[i] - centroid[d]);
+    }
+#pragma omp simd
+    for (int i = first; i < count; i++)
+    {
+      labels[i] = distance[i] < best[i] ? j : labels[i];
+      best[i] = distance[i] < best[i] ? distance[i] : best[i];
+    }
+  }
+
+  for (int i = first; i < count; i++)
+  {
+    float *centroid = &s->centroids[(size_t)labels[i] * s->dims];
+    float rate = 1.0f / ++s->counts[labels[i]];
+    for (int d = 0; d < s->dims; d++)
+      centroid[d] += rate * (s->batch[(size_t)d * STREAM_BATCH + i] - centroid[d]);
+  }
+  return count;
+}
+
+void stream_free(StreamClusterer *s)
+{
+  for (int p = 0; s->shards != NULL && p < s->producers; p++)
+    free(s->shards[p].items);
+  free(s->shards);
+  free(s->centroids);
+  free(s->counts);
+  free(s->batch);
+  free(s->labels);
+  free(s->distances);
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,42 @@
+/*
+Online k-means over a stream of points pushed by several producer
+threads. Every producer owns a single-producer ring, so pushes never
+contend, and one consumer drains the rings in batches that are assigned
+together before the centroids move (MacQueen updates)
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+  _Alignas(64) _Atomic size_t head; // Points pushed, written by the producer
+  _Alignas(64) _Atomic size_t tail; // Points taken, written by the consumer
+  float *items;                     // STREAM_RING points of dims values
+} StreamShard;
+
+typedef struct
+{
+  StreamShard *shards;
+  int producers;
+  int dims;
+  int next_shard; // Shard the next poll starts from
+  float *centroids;
+  long *counts; // Points absorbed by each centroid
+  int k;
+  int seeded; // Centroids taken from the first points so far
+  float *batch; // Dimension d of point i at batch[d * STREAM_BATCH + i]
+  int *labels;
+  float *distances;
+} StreamClusterer;
+
+bool stream_init(StreamClusterer *s, int k, int dims, int producers);
+int stream_push(StreamClusterer *s, int producer, const float *points, int count);
+int stream_poll(StreamClusterer *s);
+void stream_free(StreamClusterer *s);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+Feeds load_dataset valid, corrupt and oversized compressed files.
+Every bad file must fail with NULL instead of crashing
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zstd.h>
+#include "../ingest.h"
+
+int failures = 0;
+
+#define CHECK(condition)                                                    \
+  do                                                                        \
+  {                                                                         \
+    if (!(condition))                                                       \
+    {                                                                       \
+      fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+void write_file(const char *path, const void *data, size_t size)
+{
+  FILE *file = fopen(path, "wb");
+  if (file == NULL || fwrite(data, 1, size, file) != size)
+  {
+    fprintf(stderr, "ERROR: Could not write %s\n", path);
+    exit(1);
+  }
+  fclose(file);
+}
+
+//--------------------------------------------------
+// Loads path and tells whether it succeeded with the expected size
+//--------------------------------------------------
+bool loads(const char *path, size_t expected)
+{
+  size_t size = 0;
+  bool mapped = false;
+  void *data = load_dataset(path, &size, &mapped);
+  if (data == NULL)
+    return false;
+  free_dataset(data, size, mapped);
+  return size == expected;
+}
+
+int main(void)
+{
+  char directory[] = "/tmp/test_ingest_XXXXXX";
+  if (mkdtemp(directory) == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not create a temporary directory\n");
+    return 1;
+  }
+  char path[64];
+
+  // A valid two frame file decompresses to both frames
+  float values[1024];
+  for (int i = 0; i < 1024; i++)
+    values[i] = i * 0.5f;
+  size_t bound = ZSTD_compressBound(sizeof(values));
+  char *frames = malloc(2 * bound);
+  size_t first = ZSTD_compress(frames, bound, values, sizeof(values), 3);
+  size_t second = ZSTD_compress(frames + first, bound, values, sizeof(values), 3);
+  snprintf(path, sizeof(path), "%s/valid.zst", directory);
+  write_file(path, frames, first + second);
+  CHECK(loads(path, 2 * sizeof(values)));
+
+  // The same frames cut short
+  snprintf(path, sizeof(path), "%s/truncated.zst", directory);
+  write_file(path, frames, first + second / 2);
+  CHECK(!loads(path, 2 * sizeof(values)));
+  free(frames);
+
+  // A frame header claiming 2^62 bytes of content for one 8 byte raw block
+  unsigned char oversized[] = {0x28, 0xb5, 0x2f, 0xfd, 0xc0, 0x00,
+                               0, 0, 0, 0, 0, 0, 0, 0x40,
+                               0x41, 0x00, 0x00, 1, 2, 3, 4, 5, 6, 7, 8};
+  snprintf(path, sizeof(path), "%s/oversized.zst", directory);
+  write_file(path, oversized, sizeof(oversized));
+  CHECK(!loads(path, 0));
+
+  // Two frames whose content sizes add up past SIZE_MAX
+  unsigned char overflow[2 * sizeof(oversized)];
+  memcpy(overflow, oversized, sizeof(oversized));
+  memcpy(overflow + sizeof(oversized), oversized, sizeof(oversized));
+  overflow[13] = overflow[13 + sizeof(oversized)] = 0xc0;
+  snprintf(path, sizeof(path), "%s/overflow.zst", directory);
+  write_file(path, overflow, sizeof(overflow));
+  CHECK(!loads(path, 0));
+
+  // Not zstd at all
+  unsigned char garbage[256];
+  for (size_t i = 0; i < sizeof(garbage); i++)
+    garbage[i] = (unsigned char)(i * 37 + 11);
+  snprintf(path, sizeof(path), "%s/garbage.zst", directory);
+  write_file(path, garbage, sizeof(garbage));
+  CHECK(!loads(path, 0));
+
+  const char *names[] = {"valid.zst", "truncated.zst", "oversized.zst", "overflow.zst", "garbage.zst"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+    unlink(path);
+  }
+  rmdir(directory);
+
+  if (failures > 0)
+    return 1;
+  printf("test_ingest: ok\n");
+  return 0;
+}
@@ -0,0 +1,44 @@
+"""
+Checks the shapes returned by the Python bindings. Needs `make python` first
+"""
+
+import ctypes
+import unittest
+
+import kmeans
+
+
+def column(ctype, values):
+    """(n, 1) C contiguous array of the given ctypes type"""
+    array = (ctype * 1 * len(values))()
+    for i, value in enumerate(values):
+        array[i][0] = value
+    return array
+
+
+class SingleColumnTest(unittest.TestCase):
+    def check(self, engine, samples, *args):
+        labels, centroids = engine(samples, 2, *args)
+        self.assertEqual(tuple(memoryview(labels).shape), (len(samples),))
+        self.assertEqual(tuple(memoryview(centroids).shape), (2, 1))
+        # Centroids are valid input again
+        labels, again = engine(centroids, 1, *args)
+        self.assertEqual(tuple(memoryview(labels).shape), (2,))
+        self.assertEqual(tuple(memoryview(again).shape), (1, 1))
+
+    def test_kmajority(self):
+        self.check(kmeans.kmajority, column(ctypes.c_uint64, [0, 1, 0xFF00, 0xFF01] * 8))
+
+    def test_kmodes(self):
+        self.check(kmeans.kmodes, column(ctypes.c_uint8, [1, 1, 7, 7] * 8))
+
+    def test_dtw_kmeans(self):
+        self.check(kmeans.dtw_kmeans, column(ctypes.c_float, [0.0, 0.5, 10.0, 10.5] * 8), 0)
+
+    def test_no_columns(self):
+        with self.assertRaises(ValueError):
+            kmeans.kmodes((ctypes.c_uint8 * 0 * 4)(), 2)
+
+
+if __name__ == "__main__":
+    unittest.main()